@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Cache of fixed size device blocks with the 2Q replacement policy. New blocks
+// enter a FIFO probation queue, hits there do not move them. A block evicted
+// from probation leaves its key on a ghost list, and only a block that is read
+// again while its key is there makes it into the protected LRU. A sweep such
+// as `chia plots check` reads every block once, so it cycles through probation
+// without evicting hot lookup data, and neither do reads that hit the same
+// block twice in a row.
+class BlockCache {
+public:
+    static const size_t block_size = 64 * 1024;
+    static const size_t shard_count = 16;
+
+    // A block of a device as read for one plot. The plot is part of the key so
+    // that blocks cached for a plot never serve another one that was written to
+    // the same place later.
+    struct Key {
+        uint64_t block; // device number and block number
+        uint64_t tag; // plot
+        bool operator==(const Key& other) const { return block == other.block && tag == other.tag; }
+    };
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t inserts;
+        uint64_t evictions;
+    };
+
+private:
+    static constexpr uint32_t none = UINT32_MAX;
+
+    enum Queue {
+        Free,
+        In,
+        Main,
+        Ghost,
+    };
+
+    // Nodes are allocated up front and linked into the queues and hash chains by
+    // index, so caching a block never touches the heap
+    struct Node {
+        Key key;
+        Queue queue = Free;
+        uint32_t slot = 0;
+        uint32_t length = 0; // valid bytes, less than a block at the end of a device
+        uint32_t prev = none, next = none; // in its queue, next is also the free list
+        uint32_t chain = none; // next node in the same hash bucket
+    };
+
+    struct List {
+        uint32_t head = none, tail = none; // most recent first
+        size_t size = 0;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return (key.block ^ key.tag) * 0x9e3779b97f4a7c15ull; }
+    };
+
+    struct Shard {
+        std::mutex m;
+        std::unique_ptr<uint8_t[]> arena; // one block per slot, faulted in lazily
+        std::vector<uint32_t> free_slots; // reserved for every slot
+        std::vector<Node> nodes; // one per slot and one per ghost entry
+        uint32_t free_nodes = none;
+        std::vector<uint32_t> buckets; // first node of each hash chain
+        List in, main, ghost;
+        size_t in_capacity = 0;
+        size_t ghost_capacity = 0;
+
+        uint8_t* block(uint32_t slot) { return arena.get() + static_cast<size_t>(slot) * block_size; }
+        uint32_t& bucket(const Key& key) { return buckets[KeyHash()(key) & (buckets.size() - 1)]; }
+        List& list(Queue queue) { return queue == In ? in : queue == Main ? main : ghost; }
+
+        uint32_t find(const Key& key)
+        {
+            auto n = bucket(key);
+            while (n != none && !(nodes[n].key == key)) {
+                n = nodes[n].chain;
+            }
+            return n;
+        }
+
+        // Takes a free node for key and hashes it, there is always one since
+        // at most every slot and every ghost entry has a node
+        uint32_t allocate(const Key& key)
+        {
+            auto n = free_nodes;
+            auto& node = nodes[n];
+            free_nodes = node.next;
+            auto& first = bucket(key);
+            node.key = key;
+            node.chain = first;
+            first = n;
+            return n;
+        }
+
+        // Unhashes a node that is in no queue and puts it back on the free list
+        void release(uint32_t n)
+        {
+            auto link = &bucket(nodes[n].key);
+            while (*link != n) {
+                link = &nodes[*link].chain;
+            }
+            *link = nodes[n].chain;
+            nodes[n].queue = Free;
+            nodes[n].next = free_nodes;
+            free_nodes = n;
+        }
+
+        void push_front(Queue queue, uint32_t n)
+        {
+            auto& l = list(queue);
+            auto& node = nodes[n];
+            node.queue = queue;
+            node.prev = none;
+            node.next = l.head;
+            if (l.head != none) {
+                nodes[l.head].prev = n;
+            } else {
+                l.tail = n;
+            }
+            l.head = n;
+            ++l.size;
+        }
+
+        void unlink(uint32_t n)
+        {
+            auto& node = nodes[n];
+            auto& l = list(node.queue);
+            if (node.prev != none) {
+                nodes[node.prev].next = node.next;
+            } else {
+                l.head = node.next;
+            }
+            if (node.next != none) {
+                nodes[node.next].prev = node.prev;
+            } else {
+                l.tail = node.prev;
+            }
+            --l.size;
+        }
+
+        // Frees a slot, from probation while it holds more than its share or
+        // the protected LRU is empty. Returns false if nothing can be evicted.
+        bool evict()
+        {
+            if (in.tail != none && (in.size > in_capacity || main.tail == none)) {
+                auto n = in.tail;
+                unlink(n);
+                free_slots.push_back(nodes[n].slot);
+                push_front(Ghost, n);
+                if (ghost.size > ghost_capacity) {
+                    auto oldest = ghost.tail;
+                    unlink(oldest);
+                    release(oldest);
+                }
+                return true;
+            }
+            if (main.tail != none) {
+                auto n = main.tail;
+                unlink(n);
+                free_slots.push_back(nodes[n].slot);
+                release(n);
+                return true;
+            }
+            return false;
+        }
+
+        // Moves a block to the front of the protected LRU
+        void protect(uint32_t n)
+        {
+            unlink(n);
+            push_front(Main, n);
+        }
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<uint64_t> hits { 0 }, misses { 0 }, inserts { 0 }, evictions { 0 };
+
+    Shard& shard(const Key& key) { return *shards[KeyHash()(key) >> 60]; }
+
+public:
+    explicit BlockCache(size_t bytes)
+    {
+        auto slots = std::max<size_t>(1, bytes / block_size / shard_count);
+        for (size_t i = 0; i < shard_count; ++i) {
+            auto s = std::make_unique<Shard>();
+            s->arena.reset(new uint8_t[slots * block_size]);
+            s->free_slots.reserve(slots);
+            for (uint32_t slot = slots; slot-- > 0;) {
+                s->free_slots.push_back(slot);
+            }
+            // the usual 2Q tuning, a quarter of the cache for probation and keys
+            // for half of it on the ghost list
+            s->in_capacity = std::max<size_t>(1, slots / 4);
+            s->ghost_capacity = std::max<size_t>(1, slots / 2);
+            s->nodes.resize(slots + s->ghost_capacity);
+            for (uint32_t n = s->nodes.size(); n-- > 0;) {
+                s->nodes[n].next = s->free_nodes;
+                s->free_nodes = n;
+            }
+            size_t buckets = 16;
+            while (buckets < s->nodes.size()) {
+                buckets *= 2;
+            }
+            s->buckets.assign(buckets, none);
+            shards.push_back(std::move(s));
+        }
+    }
+    BlockCache(const BlockCache&) = delete;
+
+    // Blocks are numbered per device, devices by a number unique to the process
+    static Key key(uint32_t device, uint64_t block, uint64_t tag) { return Key { (static_cast<uint64_t>(device) << 40) | block, tag }; }
+
+    // Copies size bytes at offset within the block into out. Returns false if the
+    // block, or that part of it, is not cached.
+    bool get(const Key& key, size_t offset, size_t size, uint8_t* out)
+    {
+        auto& s = shard(key);
+        {
+            std::lock_guard<std::mutex> lock(s.m);
+            auto n = s.find(key);
+            if (n != none && s.nodes[n].queue != Ghost && offset + size <= s.nodes[n].length) {
+                std::memcpy(out, s.block(s.nodes[n].slot) + offset, size);
+                if (s.nodes[n].queue == Main) {
+                    s.protect(n);
+                }
+                ++hits;
+                return true;
+            }
+        }
+        ++misses;
+        return false;
+    }
+
+    // Caches a block that was just read, length may be short at the end of a device
+    void put(const Key& key, const uint8_t* data, size_t length)
+    {
+        auto& s = shard(key);
+        std::lock_guard<std::mutex> lock(s.m);
+        auto n = s.find(key);
+        if (n != none && s.nodes[n].queue != Ghost) {
+            return; // raced with another reader
+        }
+        if (s.free_slots.empty()) {
+            if (!s.evict()) {
+                return;
+            }
+            ++evictions;
+            // eviction may have dropped the ghost entry we are about to promote
+            n = s.find(key);
+        }
+        auto slot = s.free_slots.back();
+        s.free_slots.pop_back();
+        std::memcpy(s.block(slot), data, length);
+        ++inserts;
+        if (n != none) {
+            // seen again since it left probation, it is hot
+            s.nodes[n].slot = slot;
+            s.nodes[n].length = length;
+            s.protect(n);
+            return;
+        }
+        n = s.allocate(key);
+        s.nodes[n].slot = slot;
+        s.nodes[n].length = length;
+        s.push_front(In, n);
+    }
+
+    Stats stats() const { return Stats { hits, misses, inserts, evictions }; }
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sys/mman.h>
+#include <vector>
+
+// Fixed set of equally sized, page aligned buffers carved out of a single
+// mapping that is allocated up front, optionally backed by huge pages.
+class AlignedBufferPool {
+public:
+    static const size_t alignment = 4096;
+
+    // A buffer on loan from the pool, or a one-off allocation when the pool is
+    // exhausted or the request does not fit a pooled buffer
+    class Lease {
+    private:
+        AlignedBufferPool* pool_ = nullptr;
+        uint8_t* data_ = nullptr;
+
+    public:
+        Lease() = default;
+        Lease(AlignedBufferPool* pool, uint8_t* data)
+            : pool_(pool)
+            , data_(data) {};
+        Lease(const Lease&) = delete;
+        Lease(Lease&& other)
+            : pool_(other.pool_)
+            , data_(other.data_)
+        {
+            other.data_ = nullptr;
+        }
+        ~Lease()
+        {
+            if (!data_) {
+                return;
+            }
+            if (pool_) {
+                pool_->release(data_);
+            } else {
+                ::free(data_);
+            }
+        }
+        uint8_t* data() const { return data_; }
+        explicit operator bool() const { return !!data_; }
+    };
+
+private:
+    void* base_ = MAP_FAILED;
+    size_t mapped_ = 0;
+    size_t buffer_size_ = 0;
+    std::mutex m;
+    std::vector<uint8_t*> free_;
+
+    void release(uint8_t* data)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        free_.push_back(data);
+    }
+
+public:
+    AlignedBufferPool(size_t count, size_t buffer_size, bool hugepages)
+    {
+        buffer_size_ = (buffer_size + alignment - 1) & ~(alignment - 1);
+        mapped_ = count * buffer_size_;
+        if (hugepages) {
+            // needs pages reserved in /proc/sys/vm/nr_hugepages
+            base_ = ::mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+            if (base_ == MAP_FAILED) {
+                std::cerr << "warning: no huge pages available, using transparent huge pages" << std::endl;
+            }
+        }
+        if (base_ == MAP_FAILED) {
+            base_ = ::mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base_ == MAP_FAILED) {
+                std::cerr << "failed to allocate buffer pool" << std::endl;
+                return;
+            }
+            if (hugepages) {
+                ::madvise(base_, mapped_, MADV_HUGEPAGE);
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            free_.push_back(static_cast<uint8_t*>(base_) + i * buffer_size_);
+        }
+    }
+    AlignedBufferPool(const AlignedBufferPool&) = delete;
+    ~AlignedBufferPool()
+    {
+        if (base_ != MAP_FAILED) {
+            ::munmap(base_, mapped_);
+        }
+    }
+
+    size_t buffer_size() const { return buffer_size_; }
+
+    Lease acquire(size_t size)
+    {
+        if (size <= buffer_size_) {
+            std::lock_guard<std::mutex> lock(m);
+            if (!free_.empty()) {
+                auto data = free_.back();
+                free_.pop_back();
+                return Lease(this, data);
+            }
+        }
+        void* data = nullptr;
+        if (0 != ::posix_memalign(&data, alignment, size)) {
+            return Lease();
+        }
+        return Lease(nullptr, static_cast<uint8_t*>(data));
+    }
+};
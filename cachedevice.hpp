@@ -0,0 +1,485 @@
+#pragma once
+
+#include "device.hpp"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+static const std::string CacheSignature = "PlotFS cache\n";
+
+// Second level cache of plot device blocks on a spare SSD that is kept across
+// restarts. Layout of the cache device:
+//   superblock (4 KiB): signature, then at 256 the instance, slot count and the
+//   offsets of index and data, 8 byte big endian each
+//   index: one 32 byte entry per slot naming the block it holds
+//   data: one block per slot
+// Reads that miss offer their blocks, and a background thread writes those that
+// were offered twice to the SSD, so a miss never waits for it. Nothing is
+// written through the cache: plots go to their devices directly and blocks are
+// tagged with their plot, so a cached block never outlives the data it copies.
+class CacheDevice : public FileHandle {
+public:
+    static const size_t block_size = 64 * 1024;
+    static const size_t max_pending = 64; // blocks waiting to be written, more are dropped
+
+    // A block of a plot device, named by values that survive a restart
+    struct Key {
+        uint64_t device; // leading bytes of the device id
+        uint64_t block;
+        uint64_t tag; // plot
+        bool operator==(const Key& other) const { return device == other.device && block == other.block && tag == other.tag; }
+    };
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t admitted;
+        uint64_t dropped;
+        uint64_t errors;
+    };
+
+private:
+    static const size_t superblock_size = 4096;
+    static const size_t entry_size = 32;
+
+    struct Entry {
+        Key key;
+        uint32_t length = 0; // valid bytes, 0 when the slot is empty
+    };
+
+    struct Pending {
+        Key key;
+        uint32_t length;
+        uint32_t buffer; // index into staging
+    };
+
+    uint64_t instance; // random per format, entries written before one do not check out
+    uint32_t slot_count;
+    uint64_t index_offset;
+    uint64_t data_offset;
+
+    std::mutex m;
+    std::vector<Entry> entries; // by slot
+    std::vector<uint32_t> table; // open addressing, slot + 1, 0 when empty
+    std::vector<uint32_t> versions; // bumped when a slot is reused, readers check it after reading
+    std::vector<uint8_t> referenced; // CLOCK bits, busy while a slot is being written
+    uint32_t hand = 0;
+
+    std::mutex pending_m;
+    std::condition_variable cv;
+    std::vector<Pending> pending;
+    std::vector<uint32_t> free_buffers;
+    std::vector<uint8_t> staging; // max_pending blocks
+    std::vector<uint64_t> seen; // bits of keys offered once since the last reset
+    size_t seen_count = 0;
+    bool stopping = false;
+    std::thread writer;
+
+    std::atomic<uint64_t> hits { 0 }, misses { 0 }, admitted { 0 }, dropped { 0 }, errors { 0 };
+
+    static const uint8_t busy = 2;
+
+    static uint64_t hash(const Key& key)
+    {
+        auto h = (key.device * 0x9e3779b97f4a7c15ull) ^ (key.block * 0xc2b2ae3d27d4eb4full) ^ key.tag;
+        return h ^ (h >> 29);
+    }
+
+    static void put64(uint8_t* p, uint64_t value)
+    {
+        for (auto i = 7; i >= 0; --i, value >>= 8) {
+            p[i] = static_cast<uint8_t>(value);
+        }
+    }
+
+    static uint64_t get64(const uint8_t* p)
+    {
+        uint64_t value = 0;
+        for (auto i = 0; i < 8; ++i) {
+            value = (value << 8) | p[i];
+        }
+        return value;
+    }
+
+    uint32_t check(uint32_t slot, const Entry& entry) const
+    {
+        auto h = hash(entry.key) ^ ((instance + slot) * 0xff51afd7ed558ccdull) ^ entry.length;
+        return static_cast<uint32_t>(h ^ (h >> 32));
+    }
+
+    uint32_t find(const Key& key) const
+    {
+        auto mask = table.size() - 1;
+        for (auto i = hash(key) & mask; table[i] != 0; i = (i + 1) & mask) {
+            if (entries[table[i] - 1].key == key) {
+                return table[i] - 1;
+            }
+        }
+        return UINT32_MAX;
+    }
+
+    void insert(uint32_t slot)
+    {
+        auto mask = table.size() - 1;
+        auto i = hash(entries[slot].key) & mask;
+        while (table[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        table[i] = slot + 1;
+    }
+
+    // Removes the slot holding key, moving later entries of the probe sequence
+    // back into the hole so that they stay reachable
+    void erase(const Key& key)
+    {
+        auto mask = table.size() - 1;
+        auto i = hash(key) & mask;
+        while (table[i] != 0 && !(entries[table[i] - 1].key == key)) {
+            i = (i + 1) & mask;
+        }
+        if (table[i] == 0) {
+            return;
+        }
+        for (auto j = (i + 1) & mask; table[j] != 0; j = (j + 1) & mask) {
+            auto home = hash(entries[table[j] - 1].key) & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i] = 0;
+    }
+
+    // Next slot to overwrite, empty or not read since the hand last passed it
+    uint32_t victim()
+    {
+        while (true) {
+            auto slot = hand;
+            hand = (hand + 1) % slot_count;
+            if (referenced[slot] == busy) {
+                continue;
+            }
+            if (entries[slot].length == 0 || !referenced[slot]) {
+                return slot;
+            }
+            referenced[slot] = 0;
+        }
+    }
+
+    bool write_entry(uint32_t slot, const Entry& entry)
+    {
+        std::array<uint8_t, entry_size> data {};
+        if (entry.length) {
+            put64(data.data(), entry.key.device);
+            put64(data.data() + 8, entry.key.block);
+            put64(data.data() + 16, entry.key.tag);
+            put64(data.data() + 24, (static_cast<uint64_t>(entry.length) << 32) | check(slot, entry));
+        }
+        return entry_size == pwrite(data.data(), data.size(), index_offset + static_cast<uint64_t>(slot) * entry_size);
+    }
+
+    bool load()
+    {
+        entries.resize(slot_count);
+        versions.assign(slot_count, 0);
+        referenced.assign(slot_count, 0);
+        size_t capacity = 16;
+        while (capacity < static_cast<size_t>(slot_count) * 2) {
+            capacity *= 2;
+        }
+        table.assign(capacity, 0);
+
+        std::vector<uint8_t> chunk(1024 * 1024);
+        size_t valid = 0;
+        for (uint32_t first = 0; first < slot_count;) {
+            auto count = std::min<size_t>(chunk.size() / entry_size, slot_count - first);
+            if (static_cast<int>(count * entry_size) != pread(chunk.data(), count * entry_size, index_offset + static_cast<uint64_t>(first) * entry_size)) {
+                std::cerr << "Error: Failed to read the cache index" << std::endl;
+                return false;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                auto p = chunk.data() + i * entry_size;
+                Entry entry { { get64(p), get64(p + 8), get64(p + 16) }, static_cast<uint32_t>(get64(p + 24) >> 32) };
+                auto slot = first + static_cast<uint32_t>(i);
+                // torn, stale or never written entries do not check out
+                if (entry.length == 0 || entry.length > block_size || check(slot, entry) != static_cast<uint32_t>(get64(p + 24)) || find(entry.key) != UINT32_MAX) {
+                    continue;
+                }
+                entries[slot] = entry;
+                insert(slot);
+                ++valid;
+            }
+            first += count;
+        }
+        std::cerr << "cache device holds " << valid << " of " << slot_count << " blocks" << std::endl;
+        return true;
+    }
+
+    // Writes a batch of offered blocks. Slots are forgotten on disk before their
+    // data is overwritten and named again only once the new data is durable, so
+    // a crash at any point leaves no entry pointing at the wrong bytes.
+    void admit(std::vector<Pending>& batch)
+    {
+        std::vector<uint32_t> slots(batch.size(), UINT32_MAX);
+        {
+            std::lock_guard<std::mutex> lock(m);
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (find(batch[i].key) != UINT32_MAX) {
+                    continue;
+                }
+                auto slot = victim();
+                if (entries[slot].length) {
+                    erase(entries[slot].key);
+                    entries[slot] = Entry {};
+                }
+                ++versions[slot];
+                referenced[slot] = busy;
+                slots[i] = slot;
+            }
+        }
+
+        auto ok = true;
+        for (auto slot : slots) {
+            ok = ok && (slot == UINT32_MAX || write_entry(slot, Entry {}));
+        }
+        ok = ok && datasync();
+        for (size_t i = 0; ok && i < batch.size(); ++i) {
+            if (slots[i] != UINT32_MAX) {
+                auto data = staging.data() + static_cast<size_t>(batch[i].buffer) * block_size;
+                ok = static_cast<int>(batch[i].length) == pwrite(data, batch[i].length, data_offset + static_cast<uint64_t>(slots[i]) * block_size);
+            }
+        }
+        ok = ok && datasync();
+        if (!ok) {
+            ++errors;
+        }
+
+        std::vector<std::pair<uint32_t, Entry>> published;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            for (size_t i = 0; i < batch.size(); ++i) {
+                auto slot = slots[i];
+                if (slot == UINT32_MAX) {
+                    continue;
+                }
+                referenced[slot] = 0;
+                // the same block may have been offered twice in one batch
+                if (!ok || find(batch[i].key) != UINT32_MAX) {
+                    continue;
+                }
+                entries[slot] = Entry { batch[i].key, batch[i].length };
+                insert(slot);
+                published.emplace_back(slot, entries[slot]);
+            }
+        }
+        // made durable by the next batch or on close, losing them is only a miss
+        for (const auto& p : published) {
+            write_entry(p.first, p.second);
+        }
+        admitted += published.size();
+    }
+
+    void run()
+    {
+        std::vector<Pending> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(pending_m);
+                cv.wait(lock, [this]() { return stopping || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+                batch.swap(pending);
+            }
+            admit(batch);
+            {
+                std::lock_guard<std::mutex> lock(pending_m);
+                for (const auto& p : batch) {
+                    free_buffers.push_back(p.buffer);
+                }
+            }
+            batch.clear();
+        }
+    }
+
+public:
+    CacheDevice(int fd, uint64_t instance, uint32_t slot_count, uint64_t index_offset, uint64_t data_offset)
+        : FileHandle(fd)
+        , instance(instance)
+        , slot_count(slot_count)
+        , index_offset(index_offset)
+        , data_offset(data_offset)
+        , staging(max_pending * block_size)
+        , seen(std::max<size_t>(1, slot_count / 16)) // 4 bits per slot, a quarter of them in use at most
+    {
+        for (uint32_t i = 0; i < max_pending; ++i) {
+            free_buffers.push_back(i);
+        }
+    }
+    CacheDevice(const CacheDevice&) = delete;
+    ~CacheDevice()
+    {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(pending_m);
+                stopping = true;
+            }
+            cv.notify_one();
+            writer.join();
+        }
+        datasync();
+    }
+
+    static Key key(uint64_t device, uint64_t block, uint64_t tag) { return Key { device, block, tag }; }
+
+    // Lays out an empty cache over the whole of path. Refuses to overwrite a
+    // plotfs device unless forced.
+    static bool format(const std::string& path, bool force = false)
+    {
+        auto fd = FileHandle::open(path, O_RDWR);
+        if (!fd) {
+            return false;
+        }
+        std::array<uint8_t, superblock_size> block {};
+        if (0 > fd->pread(block.data(), block.size(), 0)) {
+            std::cerr << "Error: Failed to read first block of " << path << std::endl;
+            return false;
+        }
+        if (!force && DeviceSignature == std::string(block.begin(), block.begin() + DeviceSignature.size())) {
+            std::cerr << "Error: " << path << " is a plotfs device, use --force to turn it into a cache" << std::endl;
+            return false;
+        }
+
+        auto size = fd->size();
+        uint64_t slots = size > superblock_size ? (size - superblock_size) / (block_size + entry_size) : 0;
+        uint64_t data = 0;
+        for (; slots > 0; --slots) {
+            data = (superblock_size + slots * entry_size + block_size - 1) / block_size * block_size;
+            if (data + slots * block_size <= size) {
+                break;
+            }
+        }
+        slots = std::min<uint64_t>(slots, UINT32_MAX - 1);
+        if (slots < max_pending) {
+            std::cerr << "Error: " << path << " is too small for a cache" << std::endl;
+            return false;
+        }
+
+        // a new instance invalidates whatever index a previous format left behind
+        std::random_device rd;
+        auto instance = (static_cast<uint64_t>(rd()) << 32) | rd();
+        block.fill(0);
+        std::copy(CacheSignature.begin(), CacheSignature.end(), block.begin());
+        put64(block.data() + 256, instance);
+        put64(block.data() + 256 + 8, slots);
+        put64(block.data() + 256 + 16, superblock_size);
+        put64(block.data() + 256 + 24, data);
+        if (static_cast<int>(block.size()) != fd->pwrite(block.data(), block.size(), 0) || !fd->datasync()) {
+            std::cerr << "Error: Failed to write cache superblock to " << path << std::endl;
+            return false;
+        }
+        std::cerr << "formatted " << path << " as a cache of " << slots << " blocks" << std::endl;
+        return true;
+    }
+
+    // Opens a cache written by format() and loads its index
+    static std::shared_ptr<CacheDevice> open(const std::string& path)
+    {
+        auto fd = FileHandle::open(path, O_RDWR);
+        if (!fd) {
+            return nullptr;
+        }
+        std::array<uint8_t, superblock_size> block {};
+        if (static_cast<int>(block.size()) != fd->pread(block.data(), block.size(), 0)
+            || CacheSignature != std::string(block.begin(), block.begin() + CacheSignature.size())) {
+            std::cerr << "Error: Missing cache signature for " << path << ", format it with plotfs --format_cache" << std::endl;
+            return nullptr;
+        }
+        auto slots = get64(block.data() + 256 + 8);
+        auto index = get64(block.data() + 256 + 16);
+        auto data = get64(block.data() + 256 + 24);
+        if (slots < max_pending || slots >= UINT32_MAX || index + slots * entry_size > data || data + slots * block_size > fd->size()) {
+            std::cerr << "Error: Invalid cache signature for " << path << std::endl;
+            return nullptr;
+        }
+        fd->advise(0, 0, POSIX_FADV_RANDOM);
+        auto cache = std::make_shared<CacheDevice>(fd->release(), get64(block.data() + 256), slots, index, data);
+        if (!cache->load()) {
+            return nullptr;
+        }
+        cache->writer = std::thread([cache = cache.get()]() { cache->run(); });
+        return cache;
+    }
+
+    // Reads a cached block into out, which must hold block_size bytes. Returns
+    // its length, or -1 if it is not cached.
+    int get(const Key& key, uint8_t* out)
+    {
+        uint32_t slot, version, length;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            slot = find(key);
+            if (slot == UINT32_MAX) {
+                ++misses;
+                return -1;
+            }
+            version = versions[slot];
+            length = entries[slot].length;
+            referenced[slot] = 1;
+        }
+        auto bytes = pread(out, length, data_offset + static_cast<uint64_t>(slot) * block_size);
+        {
+            // the slot may have been reused while it was being read
+            std::lock_guard<std::mutex> lock(m);
+            if (versions[slot] != version) {
+                ++misses;
+                return -1;
+            }
+        }
+        if (bytes != static_cast<int>(length)) {
+            ++errors;
+            return -1;
+        }
+        ++hits;
+        return length;
+    }
+
+    // Hands over a block that was just read from its device. Blocks are only
+    // written once they were offered before, so a single sweep over a plot does
+    // not wear out the SSD, and dropped when the writer is behind.
+    void offer(const Key& key, const uint8_t* data, size_t length)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_m);
+            auto bit = hash(key) % (seen.size() * 64);
+            auto& word = seen[bit / 64];
+            if (!(word & (1ull << (bit % 64)))) {
+                word |= 1ull << (bit % 64);
+                // forget everything once a quarter of the bits are set
+                if (++seen_count > seen.size() * 16) {
+                    std::fill(seen.begin(), seen.end(), 0);
+                    seen_count = 0;
+                }
+                return;
+            }
+            if (free_buffers.empty()) {
+                ++dropped;
+                return;
+            }
+            auto buffer = free_buffers.back();
+            free_buffers.pop_back();
+            std::memcpy(staging.data() + static_cast<size_t>(buffer) * block_size, data, length);
+            pending.push_back(Pending { key, static_cast<uint32_t>(length), buffer });
+        }
+        cv.notify_one();
+    }
+
+    Stats stats() const { return Stats { hits, misses, admitted, dropped, errors }; }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Compact read only index of the plots in a geometry. Plots are found by id
+// through an open addressing hash table and their shards are kept in flat
+// arrays so lookups never touch the flatbuffer. mount.plotfs fills it from the
+// geometry with add_plot() and add_shard().
+class PlotCatalog {
+public:
+    static constexpr uint32_t no_device = UINT32_MAX;
+
+    struct Entry {
+        std::array<uint8_t, 32> id;
+        uint8_t k = 0;
+        bool reserved = false; // still being added
+        uint64_t size = 0; // file size, recovery points excluded
+        uint32_t first_shard = 0;
+        uint32_t shard_count = 0;
+        const uint8_t* header = nullptr; // stored first page of the plot, points into the geometry
+        uint32_t header_size = 0;
+    };
+
+private:
+    std::vector<Entry> plots_;
+    std::vector<uint32_t> slots_; // plot index + 1, 0 when empty
+
+    // shard table, indexed by Entry::first_shard + n
+    std::vector<uint64_t> shard_offsets_; // logical offset of the shard within its plot
+    std::vector<uint64_t> shard_begins_; // physical offset of the shard data on its device
+    std::vector<uint32_t> shard_devices_; // index into Geometry::devices()
+
+    // plot ids are hashes, their leading bytes are as good as any hash
+    static uint64_t hash(const uint8_t* id)
+    {
+        uint64_t h;
+        std::memcpy(&h, id, sizeof(h));
+        return h;
+    }
+
+public:
+    const std::vector<Entry>& plots() const { return plots_; }
+    uint64_t shard_offset(uint32_t shard) const { return shard_offsets_[shard]; }
+    uint64_t shard_begin(uint32_t shard) const { return shard_begins_[shard]; }
+    uint32_t shard_device(uint32_t shard) const { return shard_devices_[shard]; }
+
+    // Stable inode number of a plot, derived from its id. The top bit keeps it
+    // clear of the root inode.
+    static uint64_t inode(const Entry& plot) { return hash(plot.id.data()) | (1ull << 63); }
+
+    const Entry* find_inode(uint64_t ino) const
+    {
+        if (slots_.empty()) {
+            return nullptr;
+        }
+        auto mask = slots_.size() - 1;
+        for (auto i = ino & mask;; i = (i + 1) & mask) {
+            auto slot = slots_[i];
+            if (slot == 0) {
+                return nullptr;
+            }
+            if (inode(plots_[slot - 1]) == ino) {
+                return &plots_[slot - 1];
+            }
+        }
+    }
+
+    const Entry* find(const uint8_t* id) const
+    {
+        if (slots_.empty()) {
+            return nullptr;
+        }
+        auto mask = slots_.size() - 1;
+        for (auto i = hash(id) & mask;; i = (i + 1) & mask) {
+            auto slot = slots_[i];
+            if (slot == 0) {
+                return nullptr;
+            }
+            const auto& plot = plots_[slot - 1];
+            if (0 == std::memcmp(plot.id.data(), id, plot.id.size())) {
+                return &plot;
+            }
+        }
+    }
+
+    // index of the shard containing offset, offset must be less than plot.size
+    uint32_t find_shard(const Entry& plot, uint64_t offset) const
+    {
+        auto begin = shard_offsets_.begin() + plot.first_shard;
+        auto end = begin + plot.shard_count;
+        return std::upper_bound(begin + 1, end, offset) - shard_offsets_.begin() - 1;
+    }
+
+    // logical offset one past the end of shard
+    uint64_t shard_end(const Entry& plot, uint32_t shard) const
+    {
+        return shard + 1 < plot.first_shard + plot.shard_count ? shard_offsets_[shard + 1] : plot.size;
+    }
+
+    // Adds a plot, followed by its shards in file order. The plot's size and
+    // shard fields are filled in by add_shard().
+    void add_plot(const Entry& plot)
+    {
+        plots_.push_back(plot);
+        plots_.back().size = 0;
+        plots_.back().first_shard = shard_begins_.size();
+        plots_.back().shard_count = 0;
+    }
+
+    // Adds the next shard of the last plot, size bytes at the physical offset
+    // begin of a device
+    void add_shard(uint64_t begin, uint64_t size, uint32_t device)
+    {
+        auto& plot = plots_.back();
+        shard_offsets_.push_back(plot.size);
+        shard_begins_.push_back(begin);
+        shard_devices_.push_back(device);
+        plot.size += size;
+        ++plot.shard_count;
+    }
+
+    // Builds the hash table once all plots are added
+    void index()
+    {
+        // keep the table at most half full
+        size_t capacity = 16;
+        while (capacity < plots_.size() * 2) {
+            capacity *= 2;
+        }
+        slots_.assign(capacity, 0);
+        auto mask = capacity - 1;
+        for (uint32_t p = 0; p < plots_.size(); ++p) {
+            auto i = hash(plots_[p].id.data()) & mask;
+            while (slots_[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = p + 1;
+        }
+    }
+};
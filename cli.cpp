@@ -1,14 +1,14 @@
+#include "cachedevice.hpp"
 #include "plotfs.hpp"
 
 #include "CLI11.hpp"
 
 std::vector<uint8_t> to_vector(const std::string& id)
 {
-    std::vector<uint8_t> id_;
-    for (auto i = 0; i < id.length(); i += 2) {
-        std::string byteString = id.substr(i, 2);
-        char byte = (char)strtol(byteString.c_str(), NULL, 16);
-        id_.push_back(byte);
+    std::vector<uint8_t> id_(id.length() / 2);
+    if (id.length() % 2 || !hex_decode(id.data(), id_.size(), id_.data())) {
+        std::cerr << "invalid id: " << id << std::endl;
+        return std::vector<uint8_t>();
     }
     return id_;
 }
@@ -35,6 +35,9 @@ int main(int argc, char** argv)
     auto list_plots_opt = app.add_flag("--list_plots", list_plots, "List all plots");
     auto list_devices_opt = app.add_flag("--list_devices", list_devices, "List all devices");
 
+    std::string format_cache;
+    auto format_cache_opt = app.add_option("--format_cache", format_cache, "Format a spare SSD or partition as a read cache for mount.plotfs");
+
     bool force = false, remove_source = false;
     bool force_opt = app.add_flag("--force", force, "Force operation");
     auto remove_source_opt = app.add_flag("--remove_source", remove_source, "Removes source plot file after adding");
@@ -49,6 +52,7 @@ int main(int argc, char** argv)
 
     list_plots_opt->excludes(add_device_opt)->excludes(remove_device_opt)->excludes(fix_device_opt)->excludes(add_plot_opt)->excludes(remove_plot_opt)->excludes(list_devices_opt)->excludes(init_opt); //->excludes(force_opt);
     list_devices_opt->excludes(add_device_opt)->excludes(remove_device_opt)->excludes(fix_device_opt)->excludes(add_plot_opt)->excludes(remove_plot_opt)->excludes(list_plots_opt)->excludes(init_opt); //->excludes(force_opt);
+    format_cache_opt->excludes(add_device_opt)->excludes(remove_device_opt)->excludes(fix_device_opt)->excludes(add_plot_opt)->excludes(remove_plot_opt)->excludes(list_plots_opt)->excludes(list_devices_opt)->excludes(init_opt);
     CLI11_PARSE(app, argc, argv);
 
     if (init) {
@@ -60,6 +64,10 @@ int main(int argc, char** argv)
         return EXIT_SUCCESS;
     }
 
+    if (!format_cache.empty()) {
+        return CacheDevice::format(format_cache, force) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     if (list_devices) {
         auto g = PlotFS::loadGeometry(config_path);
         if (!g) {
@@ -68,20 +76,12 @@ int main(int argc, char** argv)
         }
 
         if (g->geom->devices()) {
-            for (const auto device : *g->geom->devices()) {
-                auto space = device->end() - device->begin();
-                if (g->geom->plots()) {
-                    for (const auto plot : *g->geom->plots()) {
-                        if (plot->shards()) { }
-                        for (const auto shard : *plot->shards()) {
-                            if (*shard->device_id() == *device->id()) {
-                                space -= shard->end() - shard->begin();
-                            }
-                        }
-                    }
-                }
-                auto size = device->end() - device->begin();
-                std::cout << to_string(*device->id()) << " " << space << "/" << size << " " << 100 - (space * 100 / size) << "% " << device->path()->c_str() << std::endl;
+            for (uint32_t i = 0; i < g->geom->devices()->size(); ++i) {
+                auto device = g->geom->devices()->Get(i);
+                const auto& usage = g->usage[i];
+                auto space = usage.available();
+                auto size = usage.size;
+                std::cout << to_string(*device->id()) << " " << space << "/" << size << " " << 100 - (space * 100 / size) << "% " << device->path()->c_str() << " " << usage.fragments << std::endl;
             }
         }
         return EXIT_SUCCESS;
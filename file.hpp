@@ -8,9 +8,32 @@
 #include <string>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+// Read only mapping of a file, unmapped when the last reference goes away
+class FileMapping {
+private:
+    void* data_ = MAP_FAILED;
+    size_t size_ = 0;
+
+public:
+    FileMapping(void* data, size_t size)
+        : data_(data)
+        , size_(size) {};
+    FileMapping(const FileMapping&) = delete;
+    ~FileMapping()
+    {
+        if (data_ != MAP_FAILED) {
+            ::munmap(data_, size_);
+        }
+    }
+    const uint8_t* data() const { return static_cast<const uint8_t*>(data_); }
+    size_t size() const { return size_; }
+};
+
 class FileHandle {
 private:
     int fd_ = -1;
@@ -58,10 +81,25 @@ public:
         return st;
     }
     uint64_t size() const { return stat().st_size; }
+    std::shared_ptr<const FileMapping> map() const
+    {
+        auto size = this->size();
+        if (size == 0) {
+            return nullptr;
+        }
+        auto data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (data == MAP_FAILED) {
+            std::cerr << "mmap error " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+        return std::make_shared<const FileMapping>(data, size);
+    }
     bool seek(off64_t offset) { return offset == ::lseek64(fd_, offset, SEEK_SET); }
     bool truncate(off64_t offset = 0) { return 0 == ::ftruncate(fd_, offset); }
     bool lock(int operation) { return 0 == ::flock(fd_, operation); }
     bool sync() { return 0 == ::syncfs(fd_); }
+    bool datasync() { return 0 == ::fdatasync(fd_); }
+    bool advise(uint64_t offset, uint64_t length, int advice) const { return 0 == ::posix_fadvise64(fd_, offset, length, advice); }
 
     int read(uint8_t* data, size_t size)
     {
@@ -78,6 +116,69 @@ public:
         return tsize;
     }
 
+    // Positional reads do not touch the file offset, so they are safe to issue
+    // concurrently on a shared descriptor
+    int pread(uint8_t* data, size_t size, uint64_t offset) const
+    {
+        auto tsize = size;
+        while (size) {
+            auto rsize = ::pread64(fd_, data, size, offset);
+            if (rsize == 0) {
+                return tsize - size;
+            } else if (rsize < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            size -= rsize, data += rsize, offset += rsize;
+        }
+        return tsize;
+    }
+
+    // Scatter read into iov. The iovec array is consumed in place on short reads.
+    int preadv(struct iovec* iov, int iovcnt, uint64_t offset) const
+    {
+        size_t total = 0;
+        while (iovcnt > 0) {
+            auto rsize = ::preadv64(fd_, iov, iovcnt, offset);
+            if (rsize == 0) {
+                break;
+            } else if (rsize < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            total += rsize, offset += rsize;
+            while (iovcnt > 0 && static_cast<size_t>(rsize) >= iov->iov_len) {
+                rsize -= iov->iov_len;
+                ++iov, --iovcnt;
+            }
+            if (iovcnt > 0) {
+                iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + rsize;
+                iov->iov_len -= rsize;
+            }
+        }
+        return total;
+    }
+
+    int pwrite(const uint8_t* data, size_t size, uint64_t offset)
+    {
+        auto tsize = size;
+        while (size) {
+            auto wsize = ::pwrite64(fd_, data, size, offset);
+            if (wsize < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            size -= wsize, data += wsize, offset += wsize;
+        }
+        return tsize;
+    }
+
     int write(const uint8_t* data, size_t size)
     {
         auto tsize = size;
@@ -91,7 +192,7 @@ public:
         return tsize;
     }
     int write(const std::string& buffer) { return ::write(fd_, buffer.c_str(), buffer.size()); }
-    int fd() { return fd_; }
+    int fd() const { return fd_; }
     int release()
     {
         auto fd = fd_;
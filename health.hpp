@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Circuit breaker for a device. After a few consecutive errors, or when reads
+// stopped completing for longer than the deadline, the device is tripped and
+// reads fail fast instead of tying up worker threads. Once the backoff expired
+// and no earlier read is still stuck on the device, a single probe read is let
+// through, which closes the circuit on success and trips it again with twice
+// the backoff on failure. A device that hangs therefore holds at most one more
+// thread after it tripped, and recovers when its stuck reads finish.
+class DeviceHealth {
+public:
+    enum State : uint32_t {
+        Closed,
+        Open,
+        HalfOpen,
+    };
+    static constexpr uint32_t threshold = 3; // consecutive errors
+    static constexpr int64_t min_backoff = 1000; // ms
+    static constexpr int64_t max_backoff = 5 * 60 * 1000; // ms
+
+private:
+    std::string name;
+    int64_t deadline; // ms, 0 disables hang detection
+    std::atomic<uint32_t> state_ { Closed };
+    std::atomic<uint32_t> errors { 0 };
+    std::atomic<int64_t> backoff { min_backoff };
+    std::atomic<int64_t> retry_at { 0 };
+    std::atomic<uint32_t> inflight { 0 };
+    std::atomic<int64_t> progress { 0 }; // last time the device finished a read or went busy
+
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool hung(int64_t t) const { return deadline && inflight > 0 && t - progress > deadline; }
+
+    void trip(int64_t t, const char* reason)
+    {
+        auto s = state_.load();
+        if (s == Open) {
+            return;
+        }
+        auto b = s == HalfOpen ? std::min(backoff.load() * 2, max_backoff) : min_backoff;
+        retry_at = t + b;
+        if (!state_.compare_exchange_strong(s, Open)) {
+            return;
+        }
+        backoff = b;
+        // stuck reads get another full deadline before they count again
+        progress = t;
+        errors = 0;
+        std::cerr << name << ": " << reason << ", failing reads for " << b << "ms" << std::endl;
+    }
+
+public:
+    DeviceHealth(const std::string& name, int64_t deadline)
+        : name(name)
+        , deadline(deadline) {};
+
+    State state() const { return static_cast<State>(state_.load()); }
+
+    // True if reads may be issued without probing, for paths that can not report
+    // back whether the read succeeded
+    bool healthy()
+    {
+        auto t = now();
+        if (hung(t)) {
+            trip(t, "reads timed out");
+        }
+        return state_ == Closed;
+    }
+
+    // True if a read may be issued, possibly as the probe of a tripped device.
+    // The read must then be bracketed by begin() and end().
+    bool allow()
+    {
+        auto t = now();
+        if (hung(t)) {
+            trip(t, "reads timed out");
+        }
+        auto s = state_.load();
+        if (s == Closed) {
+            return true;
+        }
+        if (s == Open && t >= retry_at && inflight == 0) {
+            return state_.compare_exchange_strong(s, HalfOpen);
+        }
+        return false; // tripped, reads are still stuck, or a probe is in flight
+    }
+
+    void begin()
+    {
+        if (0 == inflight++) {
+            progress = now();
+        }
+    }
+
+    void end(bool ok)
+    {
+        auto t = now();
+        progress = t;
+        --inflight;
+        if (ok) {
+            errors = 0;
+            auto s = state_.load();
+            if (s != Closed && state_.compare_exchange_strong(s, Closed)) {
+                std::cerr << name << ": recovered" << std::endl;
+            }
+            return;
+        }
+        if (++errors >= threshold || state_ == HalfOpen) {
+            trip(t, "too many read errors");
+        }
+    }
+};
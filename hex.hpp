@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Hex codec for device and plot ids. Both directions handle 16 bytes at a time
+// with SSE2 on x86-64 or NEON on arm64, and fall back to a lookup table for the
+// tail and on other targets.
+
+namespace hex_detail {
+
+static const char digits[] = "0123456789abcdef";
+
+// Value of a hex digit, or -1
+inline int value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+#if defined(__SSE2__)
+// nibbles (0-15 in each byte) to lowercase ascii
+inline __m128i to_ascii(__m128i x)
+{
+    auto letter = _mm_cmpgt_epi8(x, _mm_set1_epi8(9));
+    return _mm_add_epi8(x, _mm_add_epi8(_mm_set1_epi8('0'), _mm_and_si128(letter, _mm_set1_epi8('a' - '0' - 10))));
+}
+
+// ascii to nibbles, clears valid if any byte is not a hex digit
+inline __m128i from_ascii(__m128i c, bool& valid)
+{
+    auto digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    auto letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    // unsigned x <= n is max(x, n) == n
+    auto is_digit = _mm_cmpeq_epi8(_mm_max_epu8(digit, _mm_set1_epi8(9)), _mm_set1_epi8(9));
+    auto is_letter = _mm_cmpeq_epi8(_mm_max_epu8(letter, _mm_set1_epi8(5)), _mm_set1_epi8(5));
+    valid &= 0xffff == _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+    return _mm_or_si128(_mm_and_si128(is_digit, digit), _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+// 16 nibbles in ascii order to 8 bytes, one per 16 bit lane
+inline __m128i pack_nibbles(__m128i x)
+{
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(x, _mm_set1_epi16(0x00ff)), 4), _mm_srli_epi16(x, 8));
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+inline uint8x16_t from_ascii(uint8x16_t c, bool& valid)
+{
+    auto digit = vsubq_u8(c, vdupq_n_u8('0'));
+    auto letter = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    auto is_digit = vcleq_u8(digit, vdupq_n_u8(9));
+    auto is_letter = vcleq_u8(letter, vdupq_n_u8(5));
+    valid &= 0xff == vminvq_u8(vorrq_u8(is_digit, is_letter));
+    return vbslq_u8(is_digit, digit, vaddq_u8(letter, vdupq_n_u8(10)));
+}
+#endif
+
+}
+
+// Writes 2 * size lowercase hex digits to out, without a terminator
+inline void hex_encode(const uint8_t* data, size_t size, char* out)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16, out += 32) {
+        auto in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        auto mask = _mm_set1_epi8(0x0f);
+        auto hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+        auto lo = _mm_and_si128(in, mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), hex_detail::to_ascii(_mm_unpacklo_epi8(hi, lo)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), hex_detail::to_ascii(_mm_unpackhi_epi8(hi, lo)));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    auto table = vld1q_u8(reinterpret_cast<const uint8_t*>(hex_detail::digits));
+    for (; i + 16 <= size; i += 16, out += 32) {
+        auto in = vld1q_u8(data + i);
+        uint8x16x2_t ascii = { { vqtbl1q_u8(table, vshrq_n_u8(in, 4)), vqtbl1q_u8(table, vandq_u8(in, vdupq_n_u8(0x0f))) } };
+        vst2q_u8(reinterpret_cast<uint8_t*>(out), ascii);
+    }
+#endif
+    for (; i < size; ++i) {
+        *out++ = hex_detail::digits[data[i] >> 4];
+        *out++ = hex_detail::digits[data[i] & 0x0f];
+    }
+}
+
+// Reads 2 * size hex digits of either case from hex into size bytes at out.
+// Returns false if any of them is not a hex digit.
+inline bool hex_decode(const char* hex, size_t size, uint8_t* out)
+{
+    size_t i = 0;
+    auto valid = true;
+#if defined(__SSE2__)
+    for (; i + 16 <= size; i += 16, hex += 32) {
+        auto a = hex_detail::from_ascii(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex)), valid);
+        auto b = hex_detail::from_ascii(_mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + 16)), valid);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(hex_detail::pack_nibbles(a), hex_detail::pack_nibbles(b)));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 16 <= size; i += 16, hex += 32) {
+        auto ascii = vld2q_u8(reinterpret_cast<const uint8_t*>(hex));
+        auto hi = hex_detail::from_ascii(ascii.val[0], valid);
+        auto lo = hex_detail::from_ascii(ascii.val[1], valid);
+        vst1q_u8(out + i, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+    }
+#endif
+    for (; i < size; ++i, hex += 2) {
+        auto hi = hex_detail::value(hex[0]);
+        auto lo = hex_detail::value(hex[1]);
+        valid &= hi >= 0 && lo >= 0;
+        out[i] = ((hi & 0x0f) << 4) | (lo & 0x0f);
+    }
+    return valid;
+}
+
+inline std::string hex_string(const uint8_t* data, size_t size)
+{
+    std::string s(size * 2, '\0');
+    hex_encode(data, size, &s[0]);
+    return s;
+}
+
+// Longest plot filename including the terminator, "plot-k255-<64 digits>.plot"
+static const size_t plot_filename_max = 80;
+
+// Writes the filename of a plot, "plot-k32-<id>.plot" or ".tmp" while it is
+// being added, terminated, into out. Returns its length without the terminator,
+// or 0 if it does not fit in size bytes.
+inline size_t format_plot_filename(char* out, size_t size, uint8_t k, const uint8_t* id, bool reserved)
+{
+    char buffer[plot_filename_max];
+    auto p = buffer;
+    std::memcpy(p, "plot-k", 6), p += 6;
+    if (k >= 100) {
+        *p++ = '0' + k / 100;
+    }
+    if (k >= 10) {
+        *p++ = '0' + k / 10 % 10;
+    }
+    *p++ = '0' + k % 10;
+    *p++ = '-';
+    hex_encode(id, 32, p), p += 64;
+    auto suffix = reserved ? ".tmp" : ".plot";
+    auto suffix_length = reserved ? 4 : 5;
+    std::memcpy(p, suffix, suffix_length), p += suffix_length;
+    size_t length = p - buffer;
+    if (length + 1 > size) {
+        return 0;
+    }
+    std::memcpy(out, buffer, length);
+    out[length] = '\0';
+    return length;
+}
+
+// Parses a name written by format_plot_filename(). Returns false if it is not
+// exactly such a name, so uppercase digits or a zero padded k do not alias it.
+inline bool parse_plot_filename(const char* name, uint8_t& k, uint8_t* id, bool& reserved)
+{
+    if (0 != std::strncmp(name, "plot-k", 6)) {
+        return false;
+    }
+    name += 6;
+    unsigned value = 0;
+    auto digits = 0;
+    if (name[0] == '0' && name[1] != '-') {
+        return false;
+    }
+    for (; *name >= '0' && *name <= '9' && digits < 3; ++name, ++digits) {
+        value = value * 10 + (*name - '0');
+    }
+    if (digits == 0 || value > 255 || *name++ != '-') {
+        return false;
+    }
+    // the terminator stops the length check before reading past the name
+    if (strnlen(name, 64) < 64 || !hex_decode(name, 32, id)) {
+        return false;
+    }
+    // hex_decode takes either case, readdir only lists lowercase
+    char lowercase[64];
+    hex_encode(id, 32, lowercase);
+    if (0 != std::memcmp(name, lowercase, sizeof(lowercase))) {
+        return false;
+    }
+    name += 64;
+    k = value;
+    if (0 == std::strcmp(name, ".plot")) {
+        reserved = false;
+    } else if (0 == std::strcmp(name, ".tmp")) {
+        reserved = true;
+    } else {
+        return false;
+    }
+    return true;
+}
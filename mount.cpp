@@ -1,20 +1,30 @@
-#define FUSE_USE_VERSION 31
+// CMake selects 312 when libfuse is new enough for --max_threads
+#ifndef FUSE_USE_VERSION
+#define FUSE_USE_VERSION 34
+#endif
 
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <condition_variable>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse3/fuse.h>
+#include <functional>
+#include <fuse3/fuse_lowlevel.h>
 #include <map>
 #include <mutex>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <thread>
 
+#include "catalog.hpp"
 #include "plotfs.hpp"
-
-static struct options {
-    const char* config_path;
-} options;
+#include "publish.hpp"
+#include "readpath.hpp"
+#include "workers.hpp"
 
 #define OPTION(t, p)                      \
     {                                     \
@@ -23,262 +33,784 @@ static struct options {
 static const struct fuse_opt option_spec[] = {
     OPTION("--c=%s", config_path),
     OPTION("--config=%s", config_path),
+    OPTION("--max_threads=%u", max_threads),
+    OPTION("--max_idle_threads=%u", max_idle_threads),
+    OPTION("--clone_fd", clone_fd),
+    OPTION("--kernel_cache", kernel_cache),
+    OPTION("--cache_timeout=%u", cache_timeout),
+    OPTION("--splice", splice),
+    OPTION("--io_uring", io_uring),
+    OPTION("--io_uring_depth=%u", io_uring_depth),
+    OPTION("--queue_depth=%u", queue_depth),
+    OPTION("--readahead=%u", readahead),
+    OPTION("--direct", direct),
+    OPTION("--hugepages", hugepages),
+    OPTION("--read_timeout=%u", read_timeout),
+    OPTION("--stripe_threads=%u", stripe_threads),
+    OPTION("--pin_tables=%u", pin_tables),
+    OPTION("--block_cache=%u", block_cache),
+    OPTION("--cache_device=%s", cache_device),
     FUSE_OPT_END
 };
 
-auto loadGeometry(bool force)
-{
-    static std::mutex m;
-    static std::shared_ptr<const struct PlotFS::GeometryRO> geometry;
-    std::lock_guard<std::mutex> lock(m);
-    if (!geometry || force) {
-        geometry = PlotFS::loadGeometry(options.config_path);
+
+// Long lived table of open devices keyed by device id
+class DevicePool {
+private:
+    std::mutex m;
+    std::map<std::vector<uint8_t>, std::shared_ptr<PooledDevice>> devices;
+    uint32_t next_cache_id = 0;
+
+public:
+    // Called whenever the geometry is (re)loaded, returns the devices in the same
+    // order as Geometry::devices(). Devices that kept their id and path keep their
+    // descriptor, everything else is dropped once the last open file referencing
+    // it is released. Devices that failed to open are retried.
+    std::vector<std::shared_ptr<PooledDevice>> refresh(const Geometry& geom)
+    {
+        std::vector<std::shared_ptr<PooledDevice>> ordered;
+        std::map<std::vector<uint8_t>, std::shared_ptr<PooledDevice>> next;
+        std::lock_guard<std::mutex> lock(m);
+        if (geom.devices()) {
+            for (const auto device : *geom.devices()) {
+                if (!device->id() || !device->path()) {
+                    ordered.emplace_back();
+                    continue;
+                }
+                auto id = std::vector<uint8_t>(device->id()->begin(), device->id()->end());
+                auto it = devices.find(id);
+                if (it != devices.end() && it->second->handle && it->second->path == device->path()->str()) {
+                    next.emplace(id, it->second);
+                    ordered.push_back(it->second);
+                    continue;
+                }
+                auto d = std::make_shared<PooledDevice>();
+                d->path = device->path()->str();
+                d->health = std::make_unique<DeviceHealth>(d->path, options.read_timeout);
+                d->cache_id = ++next_cache_id;
+                std::memcpy(&d->stable_id, id.data(), std::min(id.size(), sizeof(d->stable_id)));
+                d->handle = FileHandle::open(d->path);
+                if (d->handle && options.direct) {
+                    d->direct = FileHandle::open(d->path, O_RDONLY | O_DIRECT);
+                }
+                if (d->handle && options.readahead) {
+                    d->handle->advise(0, 0, POSIX_FADV_RANDOM);
+                    d->sequential = FileHandle::open(d->path);
+                    if (d->sequential) {
+                        d->sequential->advise(0, 0, POSIX_FADV_SEQUENTIAL);
+                    }
+                }
+                if (d->handle && options.queue_depth) {
+                    d->scheduler = std::make_unique<IoScheduler>(d->handle, options.queue_depth);
+                }
+#ifdef PLOTFS_HAVE_IO_URING
+                if (d->handle && uring) {
+                    d->uring = uring;
+                    d->uring_file = uring->register_file(d->handle->fd());
+                }
+#endif
+                next.emplace(id, d);
+                ordered.push_back(d);
+            }
+        }
+        devices.swap(next);
+        return ordered;
     }
-    return geometry;
+};
+
+static DevicePool devices;
+
+// Formats the filename of a plot into out, which holds plot_filename_max bytes
+size_t plot_filename(const PlotCatalog::Entry& plot, char* out)
+{
+    return format_plot_filename(out, plot_filename_max, plot.k, plot.id.data(), plot.reserved);
 }
 
-std::vector<uint8_t> path_to_plot_id(const std::string& path)
+static double cache_timeout()
 {
-    int k = 0;
-    std::vector<uint8_t> id(32);
-    if (33 != std::sscanf(path.c_str(), "/plot-k%d-%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx", //
-            &k, &id[0], &id[1], &id[2], &id[3], &id[4], &id[5], &id[6], &id[7], &id[8], &id[9], &id[10], &id[11], &id[12], &id[13], &id[14], &id[15], //
-            &id[16], &id[17], &id[18], &id[19], &id[20], &id[21], &id[22], &id[23], &id[24], &id[25], &id[26], &id[27], &id[28], &id[29], &id[30], &id[31])) {
-        return std::vector<uint8_t>();
-    }
-    return id;
+    return options.kernel_cache ? options.cache_timeout : 1.0;
 }
 
-std::string plot_filename(const Plot& plot)
+static void fill_root_attr(struct stat* stbuf)
 {
-    return std::string("plot-k") + std::to_string(plot.k()) + "-" + to_string(*plot.id()) + ((plot.flags() & PlotFlags_Reserved) ? std::string(".tmp") : std::string(".plot"));
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = FUSE_ROOT_ID;
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
 }
 
-static void* init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+static void fill_plot_attr(const PlotCatalog::Entry& plot, struct stat* stbuf)
 {
-    (void)conn;
-    cfg->kernel_cache = 0;
-    cfg->direct_io = 0;
-    return nullptr;
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = PlotCatalog::inode(plot);
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = plot.size;
 }
 
-struct shard_data {
-    uint64_t begin;
-    uint64_t end;
-    std::string dev_path;
+// The root directory rendered once into the format readdir or readdirplus
+// replies with, so a listing is a copy of a slice of it. Offsets are entry
+// indexes, 0 and 1 are "." and "..".
+struct DirectoryListing {
+    bool plus = false; // entries carry attributes for readdirplus
+    std::vector<char> buffer;
+    std::vector<size_t> offsets; // where each entry starts, then the end of the buffer
+
+    void add(const char* name, const struct stat& attr)
+    {
+        // the request is not used to encode entries
+        auto next = offsets.size();
+        size_t entry_size;
+        if (plus) {
+            struct fuse_entry_param e;
+            memset(&e, 0, sizeof(e));
+            e.ino = attr.st_ino;
+            e.attr = attr;
+            e.attr_timeout = cache_timeout();
+            e.entry_timeout = cache_timeout();
+            entry_size = fuse_add_direntry_plus(nullptr, nullptr, 0, name, &e, next);
+            buffer.resize(offsets.back() + entry_size);
+            fuse_add_direntry_plus(nullptr, buffer.data() + offsets.back(), entry_size, name, &e, next);
+        } else {
+            entry_size = fuse_add_direntry(nullptr, nullptr, 0, name, &attr, next);
+            buffer.resize(offsets.back() + entry_size);
+            fuse_add_direntry(nullptr, buffer.data() + offsets.back(), entry_size, name, &attr, next);
+        }
+        offsets.push_back(buffer.size());
+    }
+
+    void build(const PlotCatalog& catalog)
+    {
+        const auto& plots = catalog.plots();
+        // header, attributes with plus, and a padded plot filename
+        buffer.reserve((plots.size() + 2) * (plus ? 256 : 104));
+        offsets.reserve(plots.size() + 3);
+        offsets.push_back(0);
+        struct stat attr;
+        fill_root_attr(&attr);
+        add(".", attr);
+        add("..", attr);
+        char filename[plot_filename_max];
+        for (const auto& plot : plots) {
+            plot_filename(plot, filename);
+            fill_plot_attr(plot, &attr);
+            add(filename, attr);
+        }
+    }
+
+    // The entries starting at index offset that fit in size bytes
+    std::pair<const char*, size_t> page(off_t offset, size_t size) const
+    {
+        if (offset < 0 || static_cast<size_t>(offset) + 1 >= offsets.size()) {
+            return { nullptr, 0 };
+        }
+        auto begin = offsets.begin() + offset;
+        auto end = std::upper_bound(begin, offsets.end(), *begin + size) - 1;
+        return { buffer.data() + *begin, *end - *begin };
+    }
 };
-// TODO dont unpack the geometry to get shard_data
-static const std::vector<shard_data> get_plot_data(const std::vector<uint8_t>& plot_id)
-{
-    auto g = loadGeometry(false);
-    if (!g || !g->geom || !g->geom->plots() || !g->geom->devices()) {
-        return std::vector<shard_data>();
+
+// Everything derived from one version of the geometry file
+struct Snapshot : ReadView, std::enable_shared_from_this<Snapshot> {
+    std::shared_ptr<const struct PlotFS::GeometryRO> geometry;
+
+    // Built by the first readdir, or readdirplus, of this generation
+    const DirectoryListing& directory(bool plus) const
+    {
+        std::call_once(directory_once[plus], [this, plus]() {
+            directory_[plus].plus = plus;
+            directory_[plus].build(catalog);
+        });
+        return directory_[plus];
     }
 
-    auto devpath = [&](const flatbuffers::Vector<uint8_t>& device_id) {
-        auto key = std::vector<uint8_t>(device_id.begin(), device_id.end());
-        for (const auto& device : *g->geom->devices()) {
-            if (*device->id() == key) {
-                return device->path()->str();
+private:
+    mutable std::once_flag directory_once[2];
+    mutable DirectoryListing directory_[2];
+};
+
+// Indexes the plots of a geometry with the devices in geometry order
+static PlotCatalog build_catalog(const Geometry& geom)
+{
+    PlotCatalog catalog;
+    std::map<std::vector<uint8_t>, uint32_t> device_index;
+    if (geom.devices()) {
+        for (uint32_t i = 0; i < geom.devices()->size(); ++i) {
+            auto id = geom.devices()->Get(i)->id();
+            if (id) {
+                device_index.emplace(std::vector<uint8_t>(id->begin(), id->end()), i);
             }
         }
-        return std::string();
-    };
+    }
+    if (!geom.plots()) {
+        catalog.index();
+        return catalog;
+    }
 
-    std::vector<shard_data> shards;
-    for (const auto plot : *g->geom->plots()) {
-        if (*plot->id() == plot_id) {
-            if (!plot->shards()) {
-                continue;
-            }
-            for (const auto shard : *plot->shards()) {
-                shards.emplace_back(shard_data { shard->begin() + recovery_point_size, shard->end(), devpath(*shard->device_id()) });
-            }
-            return shards;
+    for (const auto plot : *geom.plots()) {
+        if (!plot->id() || plot->id()->size() != 32 || !plot->shards() || plot->shards()->size() == 0) {
+            continue;
+        }
+        PlotCatalog::Entry entry;
+        std::copy(plot->id()->begin(), plot->id()->end(), entry.id.begin());
+        entry.k = plot->k();
+        entry.reserved = plot->flags() & PlotFlags_Reserved;
+        if (plot->header()) {
+            entry.header = plot->header()->data();
+            entry.header_size = plot->header()->size();
+        }
+        catalog.add_plot(entry);
+        for (const auto shard : *plot->shards()) {
+            auto begin = shard->begin() + recovery_point_size;
+            auto device = shard->device_id() ? device_index.find(std::vector<uint8_t>(shard->device_id()->begin(), shard->device_id()->end())) : device_index.end();
+            catalog.add_shard(begin, shard->end() - begin, device == device_index.end() ? PlotCatalog::no_device : device->second);
         }
     }
-    return std::vector<shard_data>();
+    catalog.index();
+    return catalog;
 }
 
-static int getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi)
+// Request handlers read the current snapshot without locking, reloads are
+// serialized by reload_mutex
+static Publisher<Snapshot> snapshots;
+static std::mutex reload_mutex;
+
+// Reloads the geometry file and rebuilds the snapshot if its generation changed.
+// Returns the previous and the current snapshot.
+std::pair<std::shared_ptr<const Snapshot>, std::shared_ptr<const Snapshot>> reloadGeometry()
 {
-    (void)fi;
-    memset(stbuf, 0, sizeof(struct stat));
-    if (strcmp(path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        return 0;
-    } else {
-        auto plot_id = path_to_plot_id(path);
-        if (plot_id.empty()) {
-            return -ENOENT;
+    std::lock_guard<std::mutex> lock(reload_mutex);
+    // snapshots retired by earlier reloads may have been released since
+    snapshots.reclaim();
+    auto previous = snapshots.load();
+    auto geometry = PlotFS::loadGeometry(options.config_path);
+    if (!geometry) {
+        return { previous, previous };
+    }
+    // files written by older versions have no generation, always rebuild those
+    auto generation = geometry->geom->generation();
+    if (previous && generation != 0 && generation == previous->geometry->geom->generation()) {
+        return { previous, previous };
+    }
+    auto next = std::make_shared<Snapshot>();
+    next->geometry = geometry;
+    next->catalog = build_catalog(*geometry->geom);
+    next->devices = devices.refresh(*geometry->geom);
+    snapshots.publish(next);
+    return { previous, next };
+}
+
+// The current snapshot, only valid while the guard lives. Request handlers that
+// need it for longer take a reference with shared_from_this().
+Publisher<Snapshot>::Guard loadGeometry(bool force)
+{
+    if (force || snapshots.empty()) {
+        reloadGeometry();
+    }
+    return snapshots.read();
+}
+
+// Watches the directory holding the geometry file and calls on_change whenever
+// the file is written or replaced.
+class GeometryWatcher {
+private:
+    int fd = -1;
+    std::atomic<bool> running { false };
+    std::thread thread;
+
+public:
+    ~GeometryWatcher() { stop(); }
+
+    bool start(const std::string& path, std::function<void()> on_change)
+    {
+        auto slash = path.find_last_of('/');
+        auto dir = slash == std::string::npos ? std::string(".") : path.substr(0, slash + 1);
+        auto name = slash == std::string::npos ? path : path.substr(slash + 1);
+        fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd < 0) {
+            std::cerr << "warning: inotify_init1 failed: " << strerror(errno) << std::endl;
+            return false;
         }
-        auto shard_data = get_plot_data(plot_id);
-        if (shard_data.empty()) {
-            return -EIO;
+        if (0 > inotify_add_watch(fd, dir.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)) {
+            std::cerr << "warning: failed to watch " << dir << ": " << strerror(errno) << std::endl;
+            ::close(fd), fd = -1;
+            return false;
         }
 
-        stbuf->st_mode = S_IFREG | 0444;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = 0;
-        for (const auto& shard : shard_data) {
-            stbuf->st_size += shard.end - shard.begin;
+        running = true;
+        thread = std::thread([this, name, on_change]() {
+            alignas(struct inotify_event) char buffer[4096];
+            while (running) {
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                if (0 >= ::poll(&pfd, 1, 1000)) {
+                    continue;
+                }
+                auto changed = false;
+                ssize_t size;
+                while (0 < (size = ::read(fd, buffer, sizeof(buffer)))) {
+                    for (auto p = buffer; p < buffer + size;) {
+                        auto event = reinterpret_cast<const struct inotify_event*>(p);
+                        changed |= event->len && name == event->name;
+                        p += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+                if (changed) {
+                    // the cli writes the file in several steps, let it settle
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    while (0 < ::read(fd, buffer, sizeof(buffer))) { }
+                    on_change();
+                }
+            }
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+        if (fd >= 0) {
+            ::close(fd), fd = -1;
         }
-        return 0;
     }
+};
 
-    return -ENOENT;
-}
+static GeometryWatcher watcher;
+static struct fuse_session* session = nullptr;
 
-static int readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags)
-{
-    (void)offset;
-    (void)fi;
-    (void)flags;
+// runs the invalidations for reloads done by request handlers, only without a watcher
+static std::unique_ptr<WorkerPool> invalidator;
 
-    if (strcmp(path, "/") != 0) {
-        return -ENOENT;
+// Drop kernel dentries for plots that were added, removed or renamed between
+// two snapshots, as well as cached attributes and pages of plots that went
+// away. Must not be called from a request handler.
+static void invalidate_changes(const Snapshot* before, const Snapshot* after)
+{
+    if (!session || !before || !after || before == after) {
+        return;
     }
+    auto invalidate = [&](const PlotCatalog& from, const PlotCatalog& to, bool removed) {
+        for (const auto& plot : from.plots()) {
+            auto other = to.find(plot.id.data());
+            char filename[plot_filename_max], other_filename[plot_filename_max];
+            auto length = plot_filename(plot, filename);
+            if (!other || plot_filename(*other, other_filename) != length || 0 != memcmp(filename, other_filename, length)) {
+                // also clears negative entries cached for names that just appeared
+                fuse_lowlevel_notify_inval_entry(session, FUSE_ROOT_ID, filename, length);
+                // a .tmp plot keeps its inode when it becomes a .plot, drop the pages
+                // the kernel cached while it was still being written
+                auto reserved_changed = other && plot.reserved != other->reserved;
+                if (removed && (!other || reserved_changed)) {
+                    fuse_lowlevel_notify_inval_inode(session, PlotCatalog::inode(plot), 0, 0);
+                }
+            }
+        }
+    };
+    invalidate(before->catalog, after->catalog, true);
+    invalidate(after->catalog, before->catalog, false);
+}
 
-    auto g = loadGeometry(true);
-    if (!g) {
-        return -EIO;
+// Two snapshots whose differences still have to be invalidated
+struct PendingInvalidation {
+    std::shared_ptr<const Snapshot> before, after;
+
+    static void run(void* arg)
+    {
+        auto pending = static_cast<PendingInvalidation*>(arg);
+        invalidate_changes(pending->before.get(), pending->after.get());
+        delete pending;
     }
+};
 
-    filler(buf, ".", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
-    filler(buf, "..", NULL, 0, static_cast<fuse_fill_dir_flags>(0));
+// Checks the devices of the current snapshot for hung reads at a fixed interval.
+// A hung device is otherwise only noticed by the next read that lands on it, and
+// until then the reads queued on its scheduler are not answered.
+class QueueWatchdog {
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread thread;
+
+    static void check()
+    {
+        auto g = loadGeometry(false);
+        if (!g) {
+            return;
+        }
+        for (const auto& device : g->devices) {
+            if (device && device->scheduler && !device->health->healthy()) {
+                device->scheduler->fail_queued();
+            }
+        }
+    }
 
-    if (g->geom->plots()) {
-        for (const auto plot : *g->geom->plots()) {
-            std::string filename = plot_filename(*plot);
-            if (filename.empty()) {
-                continue;
+public:
+    ~QueueWatchdog() { stop(); }
+
+    void start(std::chrono::milliseconds interval)
+    {
+        thread = std::thread([this, interval]() {
+            std::unique_lock<std::mutex> lock(m);
+            while (!cv.wait_for(lock, interval, [this]() { return stopping; })) {
+                lock.unlock();
+                check();
+                lock.lock();
             }
-            filler(buf, filename.c_str(), NULL, 0, static_cast<fuse_fill_dir_flags>(0));
+        });
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
         }
     }
+};
 
-    return 0;
-}
+static QueueWatchdog queue_watchdog;
 
-static int open(const char* path, struct fuse_file_info* fi)
+
+static void init(void*, struct fuse_conn_info* conn)
 {
-    auto plot_id = path_to_plot_id(path);
-    if (plot_id.empty()) {
-        return -ENOENT;
+    if (options.splice) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
     }
-    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-        return -EACCES;
+    // harvesters stat every plot they list, always send the attributes along
+    conn->want |= conn->capable & FUSE_CAP_READDIRPLUS;
+    conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    if (options.io_uring) {
+#ifdef PLOTFS_HAVE_IO_URING
+        // falls back to synchronous reads if the kernel says no
+        uring = UringEngine::create(options.io_uring_depth, 256 * 1024, 1024, uring_complete);
+#else
+        std::cerr << "warning: built without io_uring support, using synchronous reads" << std::endl;
+#endif
+    }
+    if (options.stripe_threads) {
+        stripe_workers = std::make_unique<WorkerPool>(options.stripe_threads);
+    }
+    if (options.block_cache) {
+        block_cache = std::make_unique<BlockCache>(options.block_cache * 1024ull * 1024);
+    }
+    if (options.cache_device) {
+        cache_device = CacheDevice::open(options.cache_device);
+        if (!cache_device) {
+            std::cerr << "warning: running without the cache device" << std::endl;
+        }
+    }
+    if (options.pin_tables) {
+        pin_cache = std::make_unique<PinCache>(options.pin_tables * 1024ull * 1024);
+        pin_loader = std::make_unique<WorkerPool>(2);
+    }
+    loadGeometry(false);
+    if (options.queue_depth && options.read_timeout) {
+        queue_watchdog.start(std::chrono::milliseconds(std::max(100u, options.read_timeout / 2)));
+    }
+    auto watching = watcher.start(options.config_path, []() {
+        auto changed = reloadGeometry();
+        invalidate_changes(changed.first.get(), changed.second.get());
+    });
+    if (!watching) {
+        invalidator = std::make_unique<WorkerPool>(1);
     }
-    auto data = get_plot_data(plot_id);
-    auto pd_ptr = new std::vector<shard_data>();
-    pd_ptr->swap(data);
-    fi->fh = reinterpret_cast<uint64_t>(pd_ptr);
-    return 0;
 }
 
-static int release(const char*, struct fuse_file_info* fi)
+static void destroy(void*)
 {
-    auto pd_ptr = reinterpret_cast<std::vector<shard_data>*>(fi->fh);
-    if (pd_ptr) {
-        delete pd_ptr;
-    }
-    return 0;
+    watcher.stop();
+    queue_watchdog.stop();
+    invalidator.reset();
+    pin_loader.reset();
+    stripe_workers.reset();
+    // writes out what is still waiting and syncs the index
+    cache_device.reset();
+#ifdef PLOTFS_HAVE_IO_URING
+    uring.reset();
+#endif
 }
 
-static int read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+
+static void lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
 {
-    auto pd_ptr = reinterpret_cast<std::vector<shard_data>*>(fi->fh);
-    if (!pd_ptr) {
-        return -EIO;
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    auto g = loadGeometry(false);
+    if (!g) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
-    auto tsize = size;
-    for (auto& shard : *pd_ptr) {
-        if (size == 0) {
-            break;
-        }
-        // offset is after this shard ends
-        auto shard_size = shard.end - shard.begin;
-        if (offset >= shard_size) {
-            offset -= shard_size;
-            continue;
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = cache_timeout();
+    e.entry_timeout = cache_timeout();
+    uint8_t k;
+    std::array<uint8_t, 32> plot_id;
+    bool reserved;
+    auto plot = parse_plot_filename(name, k, plot_id.data(), reserved) ? g->catalog.find(plot_id.data()) : nullptr;
+    // only the name readdir lists resolves
+    if (plot && (plot->k != k || plot->reserved != reserved)) {
+        plot = nullptr;
+    }
+    if (!plot) {
+        if (options.kernel_cache) {
+            // ino 0 lets the kernel cache the negative entry
+            fuse_reply_entry(req, &e);
+        } else {
+            fuse_reply_err(req, ENOENT);
         }
+        return;
+    }
+    e.ino = PlotCatalog::inode(*plot);
+    fill_plot_attr(*plot, &e.attr);
+    fuse_reply_entry(req, &e);
+}
 
-        // offset is in this shard
-        auto device = FileHandle::open(shard.dev_path);
-        if (!device) {
-            std::cerr << "failed to open " << shard.dev_path << std::endl;
-            return -EIO;
-        }
+static void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info*)
+{
+    struct stat stbuf;
+    if (ino == FUSE_ROOT_ID) {
+        fill_root_attr(&stbuf);
+        fuse_reply_attr(req, &stbuf, cache_timeout());
+        return;
+    }
+    auto g = loadGeometry(false);
+    if (!g) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    auto plot = g->catalog.find_inode(ino);
+    if (!plot) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fill_plot_attr(*plot, &stbuf);
+    fuse_reply_attr(req, &stbuf, cache_timeout());
+}
 
-        // Seek to the right place
-        if (!device->seek(shard.begin + offset)) {
-            std::cerr << "seek failed" << std::endl;
-            return -EIO;
+static void opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    if (ino != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    // without a watcher fall back to checking for changes on every listing
+    if (invalidator) {
+        auto changed = reloadGeometry();
+        if (changed.first && changed.first != changed.second) {
+            // notifying the kernel from a request handler can deadlock
+            invalidator->post(WorkerPool::Job { PendingInvalidation::run, new PendingInvalidation { changed.first, changed.second } });
         }
+    }
+    auto g = loadGeometry(false);
+    if (!g) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    // pin the snapshot so offsets stay meaningful for the whole listing
+    fi->fh = reinterpret_cast<uint64_t>(new std::shared_ptr<const Snapshot>(g->shared_from_this()));
+    fuse_reply_open(req, fi);
+}
+
+static void readdir(fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    auto g = reinterpret_cast<const std::shared_ptr<const Snapshot>*>(fi->fh);
+    if (!g) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    auto page = (*g)->directory(false).page(offset, size);
+    fuse_reply_buf(req, page.first, page.second);
+}
 
-        // Read the data
-        auto read = std::min(static_cast<uint64_t>(size), shard_size - offset);
-        read = device->read(reinterpret_cast<uint8_t*>(buf), read);
-        buf += read, size -= read, offset = 0;
+// Same as readdir, but each entry carries the attributes of the plot so that
+// stat() calls after a listing are answered from the kernel cache
+static void readdirplus(fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    auto g = reinterpret_cast<const std::shared_ptr<const Snapshot>*>(fi->fh);
+    if (!g) {
+        fuse_reply_err(req, EIO);
+        return;
     }
 
-    return tsize - size;
+    auto page = (*g)->directory(true).page(offset, size);
+    fuse_reply_buf(req, page.first, page.second);
 }
 
-static int statfs(const char*, struct statvfs* stat)
+static void releasedir(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
 {
+    delete reinterpret_cast<std::shared_ptr<const Snapshot>*>(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
     auto g = loadGeometry(false);
     if (!g) {
-        return -EIO;
-    }
-
-    stat->f_bsize = 1; /* file system block size */
-    stat->f_frsize = 1; /* fragment size */
-    stat->f_blocks = 0; /* size of fs in f_frsize units */
-    stat->f_bfree = 0; /* # free blocks */
-    stat->f_bavail = 0; /* # free blocks for unprivileged users */
-    stat->f_files = 0; /* # inodes */
-    stat->f_ffree = 0x1fffffff; /* # free inodes */
-    stat->f_favail = 0x1fffffff; /* # free inodes for unprivileged users */
-    stat->f_fsid = 0; /* file system ID */
-    stat->f_flag = 0; /* mount flags */
-    stat->f_namemax = 255; /* maximum filename length */
-
-    if (g->geom->devices()) {
-        for (const auto device : *g->geom->devices()) {
-            stat->f_blocks += device->end() - device->begin();
-        }
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    auto plot = g->catalog.find_inode(ino);
+    if (!plot) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    // keep cached pages of finished plots across opens
+    fi->keep_cache = options.kernel_cache && !plot->reserved;
+    fi->fh = reinterpret_cast<uint64_t>(acquire_open_plot(g->shared_from_this(), plot));
+    // Put the first page, as stored when the plot was added, into the page cache
+    // before the open returns, so the header read that follows never reaches
+    // the mount or the disk. The kernel only keeps whole pages, and holds no lock
+    // on a read only open that storing would wait for.
+    if (fi->keep_cache && plot->header_size == std::min<uint64_t>(PlotHeader::read_size, plot->size)) {
+        struct fuse_bufvec page = FUSE_BUFVEC_INIT(plot->header_size);
+        page.buf[0].mem = const_cast<uint8_t*>(plot->header);
+        fuse_lowlevel_notify_store(session, ino, 0, &page, static_cast<fuse_buf_copy_flags>(0));
+    }
+    fuse_reply_open(req, fi);
+}
+
+static void release(fuse_req_t req, fuse_ino_t, struct fuse_file_info* fi)
+{
+    release_open_plot(reinterpret_cast<OpenPlot*>(fi->fh));
+    fuse_reply_err(req, 0);
+}
+
+static void read(fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+    auto open_plot = reinterpret_cast<const OpenPlot*>(fi->fh);
+    if (!open_plot) {
+        fuse_reply_err(req, EIO);
+        return;
     }
+    reply_read(req, *open_plot, size, offset);
+}
 
+static void statfs(fuse_req_t req, fuse_ino_t)
+{
+    auto snapshot = loadGeometry(false);
+    if (!snapshot) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    const auto& g = snapshot->geometry;
+
+    struct statvfs stat;
+    memset(&stat, 0, sizeof(stat));
+    stat.f_bsize = 1; /* file system block size */
+    stat.f_frsize = 1; /* fragment size */
+    stat.f_blocks = 0; /* size of fs in f_frsize units */
+    stat.f_bfree = 0; /* # free blocks */
+    stat.f_bavail = 0; /* # free blocks for unprivileged users */
+    stat.f_files = 0; /* # inodes */
+    stat.f_ffree = 0x1fffffff; /* # free inodes */
+    stat.f_favail = 0x1fffffff; /* # free inodes for unprivileged users */
+    stat.f_fsid = 0; /* file system ID */
+    stat.f_flag = 0; /* mount flags */
+    stat.f_namemax = 255; /* maximum filename length */
+
+    // kept up to date per device when the geometry is loaded
+    for (const auto& usage : g->usage) {
+        stat.f_blocks += usage.size;
+        stat.f_bfree += usage.available();
+    }
+    stat.f_bavail = stat.f_bfree;
     if (g->geom->plots()) {
-        stat->f_bfree = stat->f_blocks;
-        for (const auto plot : *g->geom->plots()) {
-            for (const auto shard : *plot->shards()) {
-                stat->f_bfree -= shard->end() - shard->begin();
-            }
-        }
+        stat.f_files = g->geom->plots()->size();
+    }
+
+    fuse_reply_statfs(req, &stat);
+}
 
-        stat->f_files = g->geom->plots()->size();
-        stat->f_bavail = stat->f_bfree;
+static const char block_cache_xattr[] = "user.plotfs.block_cache";
+static const char cache_device_xattr[] = "user.plotfs.cache_device";
+
+// Cache counters are exposed as extended attributes of the root:
+// getfattr -n user.plotfs.block_cache /farm
+static void getxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size)
+{
+    char value[160];
+    int length;
+    if (ino == FUSE_ROOT_ID && block_cache && 0 == strcmp(name, block_cache_xattr)) {
+        auto stats = block_cache->stats();
+        length = snprintf(value, sizeof(value), "hits=%lu misses=%lu inserts=%lu evictions=%lu", //
+            static_cast<unsigned long>(stats.hits), static_cast<unsigned long>(stats.misses), static_cast<unsigned long>(stats.inserts), static_cast<unsigned long>(stats.evictions));
+    } else if (ino == FUSE_ROOT_ID && cache_device && 0 == strcmp(name, cache_device_xattr)) {
+        auto stats = cache_device->stats();
+        length = snprintf(value, sizeof(value), "hits=%lu misses=%lu admitted=%lu dropped=%lu errors=%lu", //
+            static_cast<unsigned long>(stats.hits), static_cast<unsigned long>(stats.misses), static_cast<unsigned long>(stats.admitted), static_cast<unsigned long>(stats.dropped), static_cast<unsigned long>(stats.errors));
+    } else {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+    if (size == 0) {
+        fuse_reply_xattr(req, length);
+    } else if (size < static_cast<size_t>(length)) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, value, length);
     }
+}
 
-    return 0;
+static void listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    // names are NUL terminated
+    char names[sizeof(block_cache_xattr) + sizeof(cache_device_xattr)];
+    size_t length = 0;
+    if (ino == FUSE_ROOT_ID && block_cache) {
+        memcpy(names + length, block_cache_xattr, sizeof(block_cache_xattr));
+        length += sizeof(block_cache_xattr);
+    }
+    if (ino == FUSE_ROOT_ID && cache_device) {
+        memcpy(names + length, cache_device_xattr, sizeof(cache_device_xattr));
+        length += sizeof(cache_device_xattr);
+    }
+    if (size == 0) {
+        fuse_reply_xattr(req, length);
+    } else if (size < length) {
+        fuse_reply_err(req, ERANGE);
+    } else {
+        fuse_reply_buf(req, names, length);
+    }
 }
 
-static const struct fuse_operations oper = {
+static const struct fuse_lowlevel_ops oper = {
+    .init = init,
+    .destroy = destroy,
+    .lookup = lookup,
     .getattr = getattr,
     .open = open,
     .read = read,
-    .statfs = statfs,
     .release = release,
+    .opendir = opendir,
     .readdir = readdir,
-    .init = init,
+    .releasedir = releasedir,
+    .statfs = statfs,
+    .getxattr = getxattr,
+    .listxattr = listxattr,
+    .readdirplus = readdirplus,
 };
 
 int main(int argc, char* argv[])
 {
+    options.readahead = 8 * 1024;
+    options.read_timeout = 5000;
+    options.stripe_threads = 8;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1) {
         return EXIT_FAILURE;
@@ -287,9 +819,89 @@ int main(int argc, char* argv[])
     if (0 == options.config_path || 0 == strlen(options.config_path)) {
         options.config_path = default_config_path.c_str();
     }
+    if (0 == options.cache_timeout) {
+        options.cache_timeout = 3600;
+    }
+    if (0 == options.io_uring_depth) {
+        options.io_uring_depth = 64;
+    }
+    if (options.direct && (options.queue_depth || options.io_uring)) {
+        // both read through the buffered descriptors
+        std::cerr << "--direct can not be combined with --queue_depth or --io_uring" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (options.direct) {
+        // one buffer per worker thread is plenty, reads beyond that allocate
+        direct_buffers = std::make_unique<AlignedBufferPool>(std::max(16u, options.max_threads), 1024 * 1024 + 2 * AlignedBufferPool::alignment, options.hugepages);
+    }
 
     fuse_opt_add_arg(&args, "-oallow_other");
-    auto ret = fuse_main(args.argc, args.argv, &oper, NULL);
+    if (options.clone_fd) {
+        fuse_opt_add_arg(&args, "-oclone_fd");
+    }
+    if (options.max_idle_threads) {
+        auto opt = std::string("-omax_idle_threads=") + std::to_string(options.max_idle_threads);
+        fuse_opt_add_arg(&args, opt.c_str());
+    }
+    if (options.max_threads) {
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+        auto opt = std::string("-omax_threads=") + std::to_string(options.max_threads);
+        fuse_opt_add_arg(&args, opt.c_str());
+#else
+        std::cerr << "warning: --max_threads requires libfuse 3.12 or newer, ignoring" << std::endl;
+#endif
+    }
+
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0) {
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+    if (opts.show_help) {
+        std::cout << "usage: " << argv[0] << " [options] <mountpoint>" << std::endl;
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return EXIT_SUCCESS;
+    }
+    if (!opts.mountpoint) {
+        std::cerr << "usage: " << argv[0] << " [options] <mountpoint>" << std::endl;
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    auto ret = EXIT_FAILURE;
+    session = fuse_session_new(&args, &oper, sizeof(oper), nullptr);
+    if (session) {
+        if (0 == fuse_set_signal_handlers(session)) {
+            if (0 == fuse_session_mount(session, opts.mountpoint)) {
+                fuse_daemonize(opts.foreground);
+                if (opts.singlethread) {
+                    ret = fuse_session_loop(session);
+                } else {
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+                    auto config = fuse_loop_cfg_create();
+                    fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+                    fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+                    fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+                    ret = fuse_session_loop_mt(session, config);
+                    fuse_loop_cfg_destroy(config);
+#else
+                    struct fuse_loop_config config;
+                    config.clone_fd = opts.clone_fd;
+                    config.max_idle_threads = opts.max_idle_threads;
+                    ret = fuse_session_loop_mt(session, &config);
+#endif
+                }
+                fuse_session_unmount(session);
+            }
+            fuse_remove_signal_handlers(session);
+        }
+        fuse_session_destroy(session);
+        session = nullptr;
+    }
+    free(opts.mountpoint);
     fuse_opt_free_args(&args);
-    return ret;
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
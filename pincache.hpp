@@ -0,0 +1,120 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Byte ranges of a plot held in RAM, such as its header and the C1 and C2
+// checkpoint tables that every proof lookup reads before the large tables
+struct PinnedPlot {
+    struct Region {
+        uint64_t offset; // logical offset in the plot
+        std::vector<uint8_t> data;
+    };
+    std::vector<Region> regions;
+
+    size_t bytes() const
+    {
+        size_t total = 0;
+        for (const auto& region : regions) {
+            total += region.data.size();
+        }
+        return total;
+    }
+
+    // The pinned bytes at offset if size bytes from there are all pinned
+    const uint8_t* find(uint64_t offset, size_t size) const
+    {
+        for (const auto& region : regions) {
+            if (offset >= region.offset && offset + size <= region.offset + region.data.size()) {
+                return region.data.data() + (offset - region.offset);
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Least recently used set of pinned plots, bounded in bytes. Open files hold on
+// to what they got from it, so evicting a plot never invalidates a read.
+class PinCache {
+public:
+    using Id = std::array<uint8_t, 32>;
+
+private:
+    struct Entry {
+        std::shared_ptr<const PinnedPlot> plot; // null while loading
+        std::list<Id>::iterator lru;
+    };
+
+    size_t budget;
+    std::mutex m;
+    std::map<Id, Entry> entries;
+    std::list<Id> lru; // most recently used first
+    size_t used = 0;
+
+public:
+    explicit PinCache(size_t budget)
+        : budget(budget) {};
+
+    size_t capacity() const { return budget; }
+
+    // Returns the pinned plot, or null with load set if the caller should load
+    // it and hand it to insert()
+    std::shared_ptr<const PinnedPlot> find(const Id& id, bool& load)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            lru.push_front(id);
+            entries.emplace(id, Entry { nullptr, lru.begin() });
+            load = true;
+            return nullptr;
+        }
+        load = false;
+        lru.splice(lru.begin(), lru, it->second.lru);
+        return it->second.plot;
+    }
+
+    // Stores a loaded plot, an empty one marks a plot that has nothing to pin
+    void insert(const Id& id, std::shared_ptr<const PinnedPlot> plot)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return;
+        }
+        auto bytes = plot->bytes();
+        if (bytes > budget) {
+            plot = std::make_shared<const PinnedPlot>();
+            bytes = 0;
+        }
+        it->second.plot = plot;
+        used += bytes;
+        // evict from the cold end, skipping plots that are still loading
+        for (auto victim = std::prev(lru.end()); used > budget && victim != lru.begin();) {
+            auto current = victim--;
+            auto entry = entries.find(*current);
+            if (entry->second.plot && entry->first != id) {
+                used -= entry->second.plot->bytes();
+                entries.erase(entry);
+                lru.erase(current);
+            }
+        }
+    }
+
+    // Forgets a plot whose load failed so a later open retries it
+    void abandon(const Id& id)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = entries.find(id);
+        if (it != entries.end() && !it->second.plot) {
+            lru.erase(it->second.lru);
+            entries.erase(it);
+        }
+    }
+};
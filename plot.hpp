@@ -1,49 +1,111 @@
 #pragma once
 
+#include <array>
 #include <iomanip>
 #include <sstream>
 #include <vector>
 
+// Header of a chia v1 plot file:
+//   "Proof of Space Plot", id (32), k (1), format description length (2, big
+//   endian) and text, memo length (2, big endian) and memo, then ten 8 byte big
+//   endian file offsets of tables 1-7 and the C1, C2 and C3 checkpoint tables.
+struct PlotHeader {
+    static constexpr size_t prefix_size = 19 + 32 + 1; // up to and including k
+    static constexpr size_t read_size = 4096; // one page, enough for any header in practice
+    enum Table {
+        C1 = 7,
+        C2 = 8,
+        C3 = 9,
+    };
+
+    std::vector<uint8_t> id;
+    uint8_t k = 0;
+    bool has_tables = false; // the rest was parsed
+    std::string format;
+    std::vector<uint8_t> memo;
+    std::array<uint64_t, 10> tables = {};
+    size_t size = 0; // bytes up to the end of the table pointers
+
+    // Parses the header from the first bytes of a plot. Returns false if not
+    // even id and k are there. Table pointers are only read from v1 plots.
+    static bool parse(const uint8_t* data, size_t size, PlotHeader& header)
+    {
+        if (size < prefix_size) {
+            return false;
+        }
+        header.id.assign(data + 19, data + 51);
+        header.k = data[51];
+        header.has_tables = false;
+        if (0 != std::memcmp(data, "Proof of Space Plot", 19)) {
+            return true;
+        }
+
+        size_t position = prefix_size;
+        auto field = [&](size_t length) -> const uint8_t* {
+            if (position + length > size) {
+                return nullptr;
+            }
+            auto p = data + position;
+            position += length;
+            return p;
+        };
+        auto length = [](const uint8_t* p) { return (static_cast<size_t>(p[0]) << 8) | p[1]; };
+        const uint8_t* p;
+        if (!(p = field(2)) || !(p = field(length(p)))) {
+            return true;
+        }
+        header.format.assign(reinterpret_cast<const char*>(p), data + position - p);
+        if (!(p = field(2)) || !(p = field(length(p)))) {
+            return true;
+        }
+        header.memo.assign(p, data + position);
+        if (!(p = field(header.tables.size() * 8))) {
+            return true;
+        }
+        for (size_t i = 0; i < header.tables.size(); ++i, p += 8) {
+            uint64_t value = 0;
+            for (auto b = 0; b < 8; ++b) {
+                value = (value << 8) | p[b];
+            }
+            header.tables[i] = value;
+        }
+        header.size = position;
+        header.has_tables = true;
+        return true;
+    }
+};
+
 class PlotFile : public FileHandle {
 private:
-    uint8_t k_;
-    std::vector<uint8_t> id_;
+    PlotHeader header_;
+    std::vector<uint8_t> prefix_;
 
 public:
-    PlotFile(int fd, uint8_t k, const std::vector<uint8_t> id)
+    PlotFile(int fd, PlotHeader header, std::vector<uint8_t> prefix)
         : FileHandle(fd)
-        , k_(k)
-        , id_(id) {};
+        , header_(std::move(header))
+        , prefix_(std::move(prefix)) {};
 
-    const uint8_t k() const { return k_; }
-    const std::vector<uint8_t>& id() const { return id_; }
+    const uint8_t k() const { return header_.k; }
+    const std::vector<uint8_t>& id() const { return header_.id; }
+    const PlotHeader& header() const { return header_; }
+    // The first page of the plot, header included, or less for a tiny file
+    const std::vector<uint8_t>& prefix() const { return prefix_; }
     static std::shared_ptr<PlotFile> open(const std::string& path)
     {
-        uint8_t k = 0;
-        std::string signature;
-        std::vector<uint8_t> id(32);
         int fd = ::open(path.c_str(), O_RDONLY);
         if (fd < 0) {
             return nullptr;
         }
 
-        signature.resize(19);
-        if (::read(fd, signature.data(), signature.size()) != signature.size()) {
-            ::close(fd);
-            return nullptr;
-        }
-        if (::read(fd, id.data(), id.size()) != id.size()) {
-            ::close(fd);
-            return nullptr;
-        }
-        if (::read(fd, &k, 1) != 1) {
-            ::close(fd);
-            return nullptr;
-        }
-        if (0 != ::lseek64(fd, 0, SEEK_SET)) {
+        std::vector<uint8_t> data(PlotHeader::read_size);
+        auto bytes = ::pread(fd, data.data(), data.size(), 0);
+        PlotHeader header;
+        if (bytes < 0 || !PlotHeader::parse(data.data(), bytes, header)) {
             ::close(fd);
             return nullptr;
         }
-        return std::make_shared<PlotFile>(fd, k, id);
+        data.resize(bytes);
+        return std::make_shared<PlotFile>(fd, std::move(header), std::move(data));
     }
-};
\ No newline at end of file
+};
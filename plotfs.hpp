@@ -3,6 +3,7 @@
 // local headers
 #include "device.hpp"
 #include "file.hpp"
+#include "hex.hpp"
 #include "plot.hpp"
 
 #include "plotfs_generated.h"
@@ -10,6 +11,7 @@
 #include <pwd.h>
 #include <sys/sendfile.h>
 
+#include <map>
 #include <random>
 
 static const auto default_config_path = std::string("/var/local/plotfs/plotfs.bin");
@@ -26,22 +28,12 @@ static bool operator==(const flatbuffers::Vector<uint8_t>& a, const flatbuffers:
 
 std::string to_string(const std::vector<uint8_t>& data)
 {
-    std::stringstream ss;
-    ss << std::hex;
-    for (auto c : data) {
-        ss << std::setw(2) << std::setfill('0') << (int)c;
-    }
-    return ss.str();
+    return hex_string(data.data(), data.size());
 }
 
 std::string to_string(const flatbuffers::Vector<uint8_t>& data)
 {
-    std::stringstream ss;
-    ss << std::hex;
-    for (auto c : data) {
-        ss << std::setw(2) << std::setfill('0') << (int)c;
-    }
-    return ss.str();
+    return hex_string(data.data(), data.size());
 }
 
 const static int recovery_point_size = 64; // DONT MODIFY THIS VALUE
@@ -65,72 +57,182 @@ std::array<uint8_t, recovery_point_size> get_recovery_point(uint64_t size, const
     return array;
 }
 
+// Space accounting of one device
+struct DeviceUsage {
+    uint64_t size = 0;
+    uint64_t used = 0; // by shards, recovery points included
+    uint64_t fragments = 0; // runs of free space
+    uint64_t available() const { return size - std::min(used, size); }
+};
+
+// Usage of each device in the order of Geometry::devices(), from one pass over
+// the shards
+static std::vector<DeviceUsage> device_usage(const Geometry& geom)
+{
+    std::vector<DeviceUsage> usage;
+    if (!geom.devices()) {
+        return usage;
+    }
+    usage.resize(geom.devices()->size());
+    std::map<std::vector<uint8_t>, uint32_t> device_index;
+    for (uint32_t i = 0; i < geom.devices()->size(); ++i) {
+        auto device = geom.devices()->Get(i);
+        usage[i].size = device->end() - device->begin();
+        if (device->id()) {
+            device_index.emplace(std::vector<uint8_t>(device->id()->begin(), device->id()->end()), i);
+        }
+    }
+
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> extents(usage.size());
+    if (geom.plots()) {
+        for (const auto plot : *geom.plots()) {
+            if (!plot->shards()) {
+                continue;
+            }
+            for (const auto shard : *plot->shards()) {
+                auto it = shard->device_id() ? device_index.find(std::vector<uint8_t>(shard->device_id()->begin(), shard->device_id()->end())) : device_index.end();
+                if (it == device_index.end()) {
+                    continue;
+                }
+                usage[it->second].used += shard->end() - shard->begin();
+                extents[it->second].emplace_back(shard->begin(), shard->end());
+            }
+        }
+    }
+
+    // every gap between the device edges and the sorted shards is a free run
+    for (uint32_t i = 0; i < usage.size(); ++i) {
+        auto& runs = extents[i];
+        std::sort(runs.begin(), runs.end());
+        auto position = geom.devices()->Get(i)->begin();
+        for (const auto& run : runs) {
+            usage[i].fragments += run.first > position;
+            position = std::max(position, run.second);
+        }
+        usage[i].fragments += geom.devices()->Get(i)->end() > position;
+    }
+    return usage;
+}
+
 class PlotFS {
 private:
+    std::string path;
     GeometryT geom;
     std::shared_ptr<FileHandle> fd;
 
     bool save()
     {
-        flatbuffers::FlatBufferBuilder fbb;
-        fbb.Finish(Geometry::Pack(fbb, &geom));
-        if (!fd->seek(0)) {
+        geom.generation++;
+        auto next = replaceGeometry(path, geom);
+        if (!next) {
             return false;
         }
-        if (!fd->truncate()) {
-            return false;
+        fd = next;
+        return true;
+    }
+
+    // Opens and locks the geometry file. The cli replaces the file instead of
+    // rewriting it, so retry if it was swapped out while we waited for the lock.
+    static std::shared_ptr<FileHandle> openLocked(const std::string& path, int flags, int operation)
+    {
+        while (true) {
+            auto fd = FileHandle::open(path, flags, 0644);
+            if (!fd) {
+                return nullptr;
+            }
+            if (!fd->lock(operation)) {
+                std::cerr << "Failed to lock " << path << ": " << strerror(errno) << std::endl;
+                return nullptr;
+            }
+            struct stat st;
+            auto fst = fd->stat();
+            if (0 == ::stat(path.c_str(), &st) && st.st_dev == fst.st_dev && st.st_ino == fst.st_ino) {
+                return fd;
+            }
+        }
+    }
+
+    // Writes the geometry next to path and renames it over path. Readers that
+    // mapped the previous file keep a consistent view of it. Must be called with
+    // the exclusive lock held, returns the new file exclusively locked.
+    static std::shared_ptr<FileHandle> replaceGeometry(const std::string& path, const GeometryT& geom)
+    {
+        auto tmp_path = path + ".tmp";
+        auto fd = FileHandle::open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (!fd) {
+            return nullptr;
+        }
+        if (!fd->lock(LOCK_EX)) {
+            ::unlink(tmp_path.c_str());
+            return nullptr;
         }
 
+        flatbuffers::FlatBufferBuilder fbb;
+        fbb.Finish(Geometry::Pack(fbb, &geom));
         auto data = fbb.GetBufferPointer();
         auto size = fbb.GetSize();
-        if (!fd->write(data, size)) {
-            return false;
+        if (fd->write(data, size) != static_cast<int>(size) || !fd->sync()) {
+            std::cerr << "Failed writing to geometry file" << std::endl;
+            ::unlink(tmp_path.c_str());
+            return nullptr;
         }
-        fd->sync();
-        return true;
+        if (0 != ::rename(tmp_path.c_str(), path.c_str())) {
+            std::cerr << "Failed to replace " << path << ": " << strerror(errno) << std::endl;
+            ::unlink(tmp_path.c_str());
+            return nullptr;
+        }
+        return fd;
     }
 
 public:
+    // The flatbuffer either points into buffer or into mapping
     struct GeometryRO {
         std::vector<uint8_t> buffer;
+        std::shared_ptr<const FileMapping> mapping;
         const Geometry* geom = nullptr;
+        std::vector<DeviceUsage> usage; // same order as Geometry::devices()
     };
 
     static std::shared_ptr<const struct GeometryRO> loadGeometry(std::shared_ptr<FileHandle>& fd)
     {
-        if (!fd->seek(0)) {
-            return nullptr;
-        }
-
-        std::vector<uint8_t> buffer(fd->size());
-        if (!fd->read(buffer.data(), buffer.size())) {
-            std::cerr << "Failed to read geometry" << std::endl;
-            return nullptr;
+        GeometryRO g;
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        if ((g.mapping = fd->map())) {
+            data = g.mapping->data(), size = g.mapping->size();
+        } else {
+            // not mappable, fall back to reading a copy
+            if (!fd->seek(0)) {
+                return nullptr;
+            }
+            g.buffer.resize(fd->size());
+            if (!fd->read(g.buffer.data(), g.buffer.size())) {
+                std::cerr << "Failed to read geometry" << std::endl;
+                return nullptr;
+            }
+            data = g.buffer.data(), size = g.buffer.size();
         }
-        if (buffer.empty()) {
+        if (size == 0) {
             std::cerr << "Geometry file is empty" << std::endl;
             return nullptr;
         }
-        auto verifier = flatbuffers::Verifier(buffer.data(), buffer.size());
+        auto verifier = flatbuffers::Verifier(data, size);
         if (!VerifyGeometryBuffer(verifier)) {
             std::cerr << "Failed to verify geometry" << std::endl;
             return nullptr;
         }
-        auto geom = GetGeometry(buffer.data());
-        return std::make_shared<const GeometryRO>(GeometryRO { std::move(buffer), geom });
+        g.geom = GetGeometry(data);
+        g.usage = device_usage(*g.geom);
+        return std::make_shared<const GeometryRO>(std::move(g));
     }
 
     static std::shared_ptr<const struct GeometryRO> loadGeometry(const std::string& path)
     {
-        auto fd = FileHandle::open(path, O_RDONLY);
+        auto fd = openLocked(path, O_RDONLY, LOCK_SH);
         if (!fd) {
             std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
             return nullptr;
         }
-        if (!fd->lock(LOCK_SH)) {
-            std::cerr << "Failed to lock " << path << ": " << strerror(errno) << std::endl;
-            return nullptr;
-        }
 
         auto g = loadGeometry(fd);
         return g;
@@ -138,25 +240,17 @@ public:
 
     static bool init(const std::string& path, bool force)
     {
-        auto fd = FileHandle::open(path, O_RDWR | O_CREAT, 0644);
+        auto fd = openLocked(path, O_RDWR | O_CREAT, LOCK_EX);
         if (!fd) {
-            return false;
-        }
-        if (!fd->lock(LOCK_EX)) {
             std::cerr << "Failed exclusive lock on file " << path << std::endl;
             return false;
         }
         if (fd->stat().st_size == 0 || force) {
             GeometryT geom;
-            flatbuffers::FlatBufferBuilder fbb;
-            fbb.Finish(Geometry::Pack(fbb, &geom));
-            auto data = fbb.GetBufferPointer();
-            auto size = fbb.GetSize();
-            if (!fd->write(data, size)) {
-                std::cerr << "Failed writing to geometry file" << std::endl;
+            geom.generation = 1;
+            if (!replaceGeometry(path, geom)) {
                 return false;
             }
-            fd->sync();
         } else {
             std::cerr << "Geometry file is not empty." << std::endl;
             return false;
@@ -165,15 +259,12 @@ public:
     }
 
     PlotFS(const std::string& path)
+        : path(path)
     {
-        fd = FileHandle::open(path, O_RDWR, 0644);
+        fd = openLocked(path, O_RDWR, LOCK_EX);
         if (!fd) {
             return;
         }
-        if (!fd->lock(LOCK_EX)) {
-            fd->close();
-            return;
-        }
         auto g = loadGeometry(fd);
         if (!g) {
             return;
@@ -421,6 +512,9 @@ public:
             newPlot->k = plot_file->k();
             newPlot->id = plot_file->id();
             newPlot->flags = PlotFlags_Reserved;
+            // lets the mount hand the first page to the kernel and find the tables
+            // to pin without reading the plot from the devices
+            newPlot->header = plot_file->prefix();
             newPlot->shards = std::move(shards);
             geom.plots.emplace_back(std::move(newPlot));
         }
@@ -471,9 +565,11 @@ public:
             std::cerr << int(100 * off_in / plot_stat.st_size) << "% finished writing to device " << to_string(device->id()) << std::endl;
         }
 
-        // Finished writing, clear the reserved flag
-        if (!fd->lock(LOCK_EX)) {
-            removePlot(plot_file->id());
+        // Finished writing, clear the reserved flag. The geometry may have been
+        // replaced while it was unlocked.
+        fd = openLocked(path, O_RDWR, LOCK_EX);
+        if (!fd) {
+            return false;
         }
         auto g = loadGeometry(fd);
         if (!g) {
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Recycles objects that are handed out and given back at a high rate, such as
+// per open file or per request state. Objects keep whatever they allocated
+// between uses, so once the pool reached its high water mark acquiring and
+// releasing does not touch the heap. Callers reset the fields they use.
+template <typename T>
+class ObjectPool {
+private:
+    std::mutex m;
+    std::vector<std::unique_ptr<T>> free_;
+
+public:
+    T* acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (!free_.empty()) {
+                auto object = free_.back().release();
+                free_.pop_back();
+                return object;
+            }
+        }
+        return new T();
+    }
+
+    void release(T* object)
+    {
+        if (!object) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m);
+        free_.emplace_back(object);
+    }
+};
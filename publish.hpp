@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Publishes the current version of an immutable object to readers that never
+// take a lock. Each reader thread owns a hazard slot that protects the version
+// it is looking at. Writers retire replaced versions and drop their reference
+// once no hazard points at them. T must derive from enable_shared_from_this so
+// readers can turn what they see into a reference that outlives the guard.
+template <typename T>
+class Publisher {
+public:
+    static const size_t max_readers = 1024;
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<bool> owned { false };
+        std::atomic<const T*> hazard { nullptr };
+    };
+
+    // Claims a slot for the calling thread and gives it back when the thread exits
+    struct LocalSlot {
+        Publisher* publisher = nullptr;
+        Slot* slot = nullptr;
+        ~LocalSlot()
+        {
+            if (slot) {
+                slot->hazard = nullptr;
+                slot->owned = false;
+            }
+        }
+    };
+
+    std::atomic<const T*> current { nullptr };
+    Slot slots[max_readers];
+
+    std::mutex writer;
+    std::shared_ptr<const T> owner; // keeps current alive
+    std::vector<std::shared_ptr<const T>> retired;
+
+    Slot* local_slot()
+    {
+        static thread_local LocalSlot local;
+        if (local.publisher == this) {
+            return local.slot;
+        }
+        if (local.slot) {
+            local.slot->owned = false;
+        }
+        local.publisher = this, local.slot = nullptr;
+        for (auto& slot : slots) {
+            auto owned = false;
+            if (slot.owned.compare_exchange_strong(owned, true)) {
+                local.slot = &slot;
+                break;
+            }
+        }
+        return local.slot;
+    }
+
+    void reclaim_locked()
+    {
+        retired.erase(std::remove_if(retired.begin(), retired.end(), [this](const std::shared_ptr<const T>& version) {
+            return std::none_of(std::begin(slots), std::end(slots), [&](const Slot& slot) { return slot.hazard == version.get(); });
+        }),
+            retired.end());
+    }
+
+public:
+    // The version a reader is looking at. Guards must not be nested on a thread.
+    class Guard {
+    private:
+        std::atomic<const T*>* hazard = nullptr;
+        const T* value = nullptr;
+        std::shared_ptr<const T> held; // only when the thread got no slot
+
+    public:
+        Guard() = default;
+        Guard(std::atomic<const T*>* hazard, const T* value)
+            : hazard(hazard)
+            , value(value) {};
+        Guard(std::shared_ptr<const T> held)
+            : value(held.get())
+            , held(std::move(held)) {};
+        Guard(const Guard&) = delete;
+        Guard(Guard&& other)
+            : hazard(other.hazard)
+            , value(other.value)
+            , held(std::move(other.held))
+        {
+            other.hazard = nullptr;
+        }
+        ~Guard()
+        {
+            if (hazard) {
+                hazard->store(nullptr);
+            }
+        }
+        const T* get() const { return value; }
+        const T* operator->() const { return value; }
+        const T& operator*() const { return *value; }
+        explicit operator bool() const { return !!value; }
+    };
+
+    Publisher() = default;
+    Publisher(const Publisher&) = delete;
+
+    bool empty() const { return !current; }
+
+    Guard read()
+    {
+        auto slot = local_slot();
+        if (!slot) {
+            // more reader threads than slots, take the slow path
+            return Guard(load());
+        }
+        const T* value;
+        do {
+            value = current.load();
+            slot->hazard.store(value);
+        } while (value != current.load());
+        return Guard(&slot->hazard, value);
+    }
+
+    // The current version as a reference, takes the writer lock
+    std::shared_ptr<const T> load()
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        return owner;
+    }
+
+    void publish(std::shared_ptr<const T> next)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        if (owner) {
+            retired.push_back(owner);
+        }
+        owner = std::move(next);
+        current.store(owner.get());
+        reclaim_locked();
+    }
+
+    // Drops retired versions that readers have moved on from
+    void reclaim()
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        reclaim_locked();
+    }
+};
@@ -0,0 +1,827 @@
+#pragma once
+
+// The read path of mount.plotfs: per open plot state and the ways a read reaches
+// the devices, from the caches and io_uring to plain positional reads. It lives
+// apart from the request handlers in mount.cpp so that tests can drive it
+// without mounting anything. Only mount.cpp and the tests include it.
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+#include "blockcache.hpp"
+#include "buffers.hpp"
+#include "cachedevice.hpp"
+#include "catalog.hpp"
+#include "file.hpp"
+#include "health.hpp"
+#include "pincache.hpp"
+#include "plot.hpp"
+#include "pool.hpp"
+#include "scheduler.hpp"
+#include "uring.hpp"
+#include "workers.hpp"
+
+// Command line of mount.plotfs, parsed in main()
+struct options {
+    const char* config_path;
+    unsigned int max_threads;
+    unsigned int max_idle_threads;
+    int clone_fd;
+    int kernel_cache;
+    unsigned int cache_timeout;
+    int splice;
+    int io_uring;
+    unsigned int io_uring_depth;
+    unsigned int queue_depth;
+    unsigned int readahead; // KiB, 0 leaves readahead to the kernel
+    int direct;
+    int hugepages;
+    unsigned int read_timeout; // ms, 0 disables hang detection
+    unsigned int stripe_threads;
+    unsigned int pin_tables; // MiB
+    unsigned int block_cache; // MiB
+    const char* cache_device;
+};
+static struct options options;
+
+#ifdef PLOTFS_HAVE_IO_URING
+static std::shared_ptr<UringEngine> uring;
+#endif
+
+// reads the parts of a read that straddles several devices concurrently
+static std::unique_ptr<WorkerPool> stripe_workers;
+
+// header and C1/C2 tables of recently opened plots, only with --pin_tables
+static std::unique_ptr<PinCache> pin_cache;
+static std::unique_ptr<WorkerPool> pin_loader;
+
+// recently read device blocks, only with --block_cache
+static std::unique_ptr<BlockCache> block_cache;
+
+// blocks kept on an SSD across restarts, only with --cache_device
+static std::shared_ptr<CacheDevice> cache_device;
+static_assert(CacheDevice::block_size == BlockCache::block_size, "both caches read whole blocks");
+
+// bounce buffers for --direct, sized for the largest FUSE read plus alignment
+static std::unique_ptr<AlignedBufferPool> direct_buffers;
+
+// A device descriptor shared by every read that lands on it. It is opened when
+// the geometry is loaded and never modified afterwards, so reads need no locking.
+struct PooledDevice {
+    std::string path;
+    std::shared_ptr<FileHandle> handle; // random access, kernel readahead off with --readahead
+    std::shared_ptr<FileHandle> sequential; // streaming, only with --readahead
+    std::shared_ptr<FileHandle> direct; // O_DIRECT, only with --direct
+    std::unique_ptr<IoScheduler> scheduler; // only with --queue_depth
+    std::unique_ptr<DeviceHealth> health;
+    uint32_t cache_id = 0; // names the device in the block cache
+    uint64_t stable_id = 0; // leading bytes of the device id, names it in the cache device
+#ifdef PLOTFS_HAVE_IO_URING
+    std::shared_ptr<UringEngine> uring;
+    int uring_file = -1; // registered file slot
+    ~PooledDevice()
+    {
+        if (uring && uring_file >= 0) {
+            uring->unregister_file(uring_file);
+        }
+    }
+#endif
+
+    // Readahead state lives in the open file description, so streaming reads get
+    // a descriptor of their own
+    const FileHandle* fd(bool streaming) const { return streaming && sequential ? sequential.get() : handle.get(); }
+
+    int read(uint8_t* data, size_t size, uint64_t offset, bool streaming = false) const
+    {
+        if (direct) {
+            return read_direct(data, size, offset);
+        }
+        auto f = fd(streaming);
+        if (!f) {
+            return -1;
+        }
+        return f->pread(data, size, offset);
+    }
+
+    // O_DIRECT needs sector aligned offsets, sizes and buffers. Widen the read to
+    // the surrounding aligned blocks and copy out the requested span.
+    int read_direct(uint8_t* data, size_t size, uint64_t offset) const
+    {
+        const auto alignment = AlignedBufferPool::alignment;
+        auto begin = offset & ~(alignment - 1);
+        auto end = (offset + size + alignment - 1) & ~(alignment - 1);
+        auto buffer = direct_buffers->acquire(end - begin);
+        if (!buffer) {
+            return -1;
+        }
+        auto bytes = direct->pread(buffer.data(), end - begin, begin);
+        if (bytes < 0) {
+            return -1;
+        }
+        auto skip = offset - begin;
+        auto available = static_cast<uint64_t>(bytes) > skip ? bytes - skip : 0;
+        auto copy = std::min(static_cast<uint64_t>(size), available);
+        std::memcpy(data, buffer.data() + skip, copy);
+        return copy;
+    }
+};
+
+// What reads need from a snapshot of the geometry
+struct ReadView {
+    PlotCatalog catalog;
+    std::vector<std::shared_ptr<PooledDevice>> devices; // same order as Geometry::devices()
+
+    const PooledDevice* device(uint32_t index) const
+    {
+        return index < devices.size() ? devices[index].get() : nullptr;
+    }
+};
+
+// Tells proof lookups, which are small scattered reads, apart from scans such as
+// `chia plots check` or copying a plot off the filesystem
+struct AccessPattern {
+    static const uint32_t streak_threshold = 4;
+    static const uint64_t tolerance = 1024 * 1024; // the kernel may reorder async reads
+
+    std::atomic<uint64_t> next { 0 }; // offset right after the previous read
+    std::atomic<uint32_t> streak { 0 }; // consecutive reads that continued the previous one
+    std::atomic<uint64_t> prefetched { 0 }; // logical offset readahead was issued up to
+
+    // Records a read and returns true if the file is being streamed
+    bool record(uint64_t offset, size_t size)
+    {
+        auto expected = next.exchange(offset + size);
+        if (offset + tolerance >= expected && offset <= expected + tolerance) {
+            auto s = streak.load();
+            if (s < streak_threshold) {
+                streak.compare_exchange_weak(s, s + 1);
+            }
+        } else {
+            streak = 0;
+        }
+        return streak >= streak_threshold;
+    }
+
+    void reset()
+    {
+        next = 0, streak = 0, prefetched = 0;
+    }
+};
+
+// Per open file state. Holding the snapshot keeps the catalog entry and the
+// device descriptors alive until release, even across geometry reloads.
+struct OpenPlot {
+    std::shared_ptr<const ReadView> snapshot;
+    const PlotCatalog::Entry* plot = nullptr;
+    mutable AccessPattern pattern;
+    std::shared_ptr<const PinnedPlot> pinned; // as of open, with --pin_tables
+};
+
+// recycled between open and release so that opening a plot does not allocate
+static ObjectPool<OpenPlot> open_plots;
+
+static void pin_plot(std::shared_ptr<const ReadView> snapshot, const PlotCatalog::Entry* plot);
+
+// Sets up a plot of snapshot that is being opened, with state recycled from the
+// pool. The first open of a plot pins it for the ones that follow.
+static OpenPlot* acquire_open_plot(std::shared_ptr<const ReadView> snapshot, const PlotCatalog::Entry* plot)
+{
+    auto open_plot = open_plots.acquire();
+    open_plot->snapshot = std::move(snapshot);
+    open_plot->plot = plot;
+    open_plot->pattern.reset();
+    if (pin_cache && !plot->reserved) {
+        auto load = false;
+        open_plot->pinned = pin_cache->find(plot->id, load);
+        if (load) {
+            pin_plot(open_plot->snapshot, plot);
+        }
+    }
+    return open_plot;
+}
+
+static void release_open_plot(OpenPlot* open_plot)
+{
+    if (open_plot) {
+        open_plot->snapshot.reset();
+        open_plot->pinned.reset();
+        open_plots.release(open_plot);
+    }
+}
+
+// A contiguous piece of a read that lives on a single device
+struct Segment {
+    const PooledDevice* device;
+    uint64_t offset; // physical offset on the device
+    size_t size;
+    uint64_t plot; // inode of the plot it belongs to
+    bool finished; // the plot is no longer being written
+};
+
+// Splits a read of an open plot into per shard segments, clamped to the file
+// size, and calls fn for each of them in file order. Returns false if fn did or
+// if a shard has no device.
+template <typename F>
+static bool for_each_segment(const OpenPlot& open_plot, uint64_t offset, size_t size, F fn)
+{
+    const auto& snapshot = *open_plot.snapshot;
+    const auto& catalog = snapshot.catalog;
+    const auto& plot = *open_plot.plot;
+    if (offset >= plot.size) {
+        return true;
+    }
+    size = std::min(static_cast<uint64_t>(size), plot.size - offset);
+
+    // most plots are a single shard
+    if (plot.shard_count == 1) {
+        auto device = snapshot.device(catalog.shard_device(plot.first_shard));
+        return device && fn(Segment { device, catalog.shard_begin(plot.first_shard) + offset, size, PlotCatalog::inode(plot), !plot.reserved });
+    }
+
+    auto last_shard = plot.first_shard + plot.shard_count;
+    for (auto i = catalog.find_shard(plot, offset); i < last_shard && size > 0; ++i) {
+        auto device = snapshot.device(catalog.shard_device(i));
+        if (!device) {
+            std::cerr << "device for shard not found" << std::endl;
+            return false;
+        }
+        auto segment_size = std::min(static_cast<uint64_t>(size), catalog.shard_end(plot, i) - offset);
+        if (!fn(Segment { device, catalog.shard_begin(i) + offset - catalog.shard_offset(i), segment_size, PlotCatalog::inode(plot), !plot.reserved })) {
+            return false;
+        }
+        size -= segment_size, offset += segment_size;
+    }
+    return true;
+}
+
+// Reads a segment through the block cache and the cache device, whichever are
+// enabled. A block missing from both is read from the device together with the
+// rest of the segment, and cached unless the plot is being streamed or is still
+// being added. blocks is scratch space of the calling read. Returns the number of
+// bytes read or -1.
+static int read_cached(const Segment& segment, uint8_t* data, bool streaming, std::vector<uint8_t>& blocks)
+{
+    const auto block_size = BlockCache::block_size;
+    const auto& device = *segment.device;
+    size_t done = 0;
+    while (done < segment.size) {
+        auto position = segment.offset + done;
+        auto within = position % block_size;
+        auto chunk = std::min(segment.size - done, block_size - within);
+        auto key = BlockCache::key(device.cache_id, position / block_size, segment.plot);
+        if (block_cache && block_cache->get(key, within, chunk, data + done)) {
+            done += chunk;
+            continue;
+        }
+
+        if (cache_device && !streaming) {
+            if (blocks.size() < block_size) {
+                blocks.resize(block_size);
+            }
+            auto length = cache_device->get(CacheDevice::key(device.stable_id, position / block_size, segment.plot), blocks.data());
+            if (length >= 0 && within + chunk <= static_cast<size_t>(length)) {
+                if (block_cache) {
+                    block_cache->put(key, blocks.data(), length);
+                }
+                std::memcpy(data + done, blocks.data() + within, chunk);
+                done += chunk;
+                continue;
+            }
+        }
+
+        auto first = position - within;
+        auto length = (segment.offset + segment.size - first + block_size - 1) / block_size * block_size;
+        if (blocks.size() < length) {
+            // the largest read the kernel sends, 1 MiB, plus the blocks it may
+            // straddle, so each thread sizes this once
+            blocks.resize(std::max(length, 1024 * 1024 + 2 * block_size));
+        }
+        auto bytes = device.read(blocks.data(), length, first, streaming);
+        if (bytes < 0) {
+            return -1;
+        }
+        if (!streaming) {
+            for (size_t b = 0; b * block_size < static_cast<size_t>(bytes); ++b) {
+                auto block_bytes = std::min(block_size, bytes - b * block_size);
+                // plots still being added change under the same inode, never keep their blocks
+                if (block_cache && segment.finished) {
+                    block_cache->put(BlockCache::key(device.cache_id, first / block_size + b, segment.plot), blocks.data() + b * block_size, block_bytes);
+                }
+                if (cache_device && segment.finished) {
+                    cache_device->offer(CacheDevice::key(device.stable_id, first / block_size + b, segment.plot), blocks.data() + b * block_size, block_bytes);
+                }
+            }
+        }
+        auto available = static_cast<size_t>(bytes) > within ? bytes - within : 0;
+        auto copy = std::min(segment.size - done, available);
+        std::memcpy(data + done, blocks.data() + within, copy);
+        return done + copy;
+    }
+    return done;
+}
+
+// Reads one segment into buf through the circuit breaker of its device.
+// Returns the number of bytes read or -1.
+static int read_segment(const Segment& segment, char* buf, bool streaming, std::vector<uint8_t>& blocks)
+{
+    auto& health = *segment.device->health;
+    if (!health.allow()) {
+        return -1;
+    }
+    health.begin();
+    auto bytes = block_cache || cache_device ? read_cached(segment, reinterpret_cast<uint8_t*>(buf), streaming, blocks)
+                                             : segment.device->read(reinterpret_cast<uint8_t*>(buf), segment.size, segment.offset, streaming);
+    health.end(bytes >= 0);
+    if (bytes < 0) {
+        std::cerr << "failed to read " << segment.device->path << std::endl;
+    }
+    return bytes;
+}
+
+// A segment of a synchronous read and where its bytes go
+struct Piece {
+    Segment segment;
+    char* data;
+    int result; // bytes read or a negative errno, 0 if never read
+};
+
+// Reads the pieces that live on one device, or all of them if device is null,
+// in file order. Stops at the first short or failed piece and between pieces if
+// the request was interrupted.
+struct StripeJob {
+    fuse_req_t req;
+    Piece* pieces;
+    size_t count;
+    const PooledDevice* device;
+    bool streaming;
+    WorkerPool::Latch* latch;
+    std::vector<uint8_t>* blocks; // owned by the requesting thread, so workers keep no buffers of their own
+
+    void read()
+    {
+        for (size_t i = 0; i < count; ++i) {
+            auto& piece = pieces[i];
+            if (device && piece.segment.device != device) {
+                continue;
+            }
+            if (req && fuse_req_interrupted(req)) {
+                piece.result = -EINTR;
+                return;
+            }
+            auto bytes = read_segment(piece.segment, piece.data, streaming, *blocks);
+            piece.result = bytes < 0 ? -EIO : bytes;
+            if (static_cast<size_t>(piece.result) != piece.segment.size) {
+                return;
+            }
+        }
+    }
+
+    static void run(void* arg)
+    {
+        auto job = static_cast<StripeJob*>(arg);
+        job->read();
+        job->latch->done();
+    }
+};
+
+// Copies size bytes at offset of an open plot into buf. Returns the number of
+// bytes read or a negative errno. When the read straddles shards on different
+// devices, each device is read by its own thread. req may be null for reads
+// that do not serve a request.
+static int read_plot(fuse_req_t req, const OpenPlot& open_plot, char* buf, size_t size, off_t offset, bool streaming)
+{
+    static thread_local std::vector<Piece> pieces;
+    static thread_local std::vector<StripeJob> jobs;
+    static thread_local std::vector<std::vector<uint8_t>> blocks; // one per job
+    pieces.clear();
+    jobs.clear();
+    auto data = buf;
+    auto ok = for_each_segment(open_plot, offset, size, [&](const Segment& segment) {
+        pieces.push_back(Piece { segment, data, 0 });
+        data += segment.size;
+        if (std::none_of(jobs.begin(), jobs.end(), [&](const StripeJob& job) { return job.device == segment.device; })) {
+            jobs.push_back(StripeJob { req, nullptr, 0, segment.device, streaming, nullptr, nullptr });
+        }
+        return true;
+    });
+    if (!ok) {
+        return -EIO;
+    }
+    if (blocks.size() < std::max<size_t>(1, jobs.size())) {
+        blocks.resize(std::max<size_t>(1, jobs.size()));
+    }
+
+    if (jobs.size() > 1 && stripe_workers) {
+        // the first device is read on this thread
+        WorkerPool::Latch latch(jobs.size() - 1);
+        for (auto& job : jobs) {
+            job.pieces = pieces.data(), job.count = pieces.size(), job.latch = &latch, job.blocks = &blocks[&job - jobs.data()];
+        }
+        for (size_t i = 1; i < jobs.size(); ++i) {
+            stripe_workers->post(WorkerPool::Job { StripeJob::run, &jobs[i] });
+        }
+        jobs[0].read();
+        latch.wait();
+    } else {
+        StripeJob { req, pieces.data(), pieces.size(), nullptr, streaming, nullptr, &blocks[0] }.read();
+    }
+
+    size_t total = 0;
+    for (const auto& piece : pieces) {
+        if (piece.result < 0) {
+            return piece.result;
+        }
+        total += piece.result;
+        if (static_cast<size_t>(piece.result) < piece.segment.size) {
+            break;
+        }
+    }
+    return total;
+}
+
+// A plot whose header and checkpoint tables are being read into the pin cache
+struct PinLoad {
+    OpenPlot open_plot;
+
+    // Reads a region, widened to whole kernel read requests so that they are
+    // served from it entirely
+    bool add(PinnedPlot& pinned, uint64_t begin, uint64_t end)
+    {
+        const uint64_t alignment = 128 * 1024;
+        begin &= ~(alignment - 1);
+        end = std::min((end + alignment - 1) & ~(alignment - 1), open_plot.plot->size);
+        if (!pinned.regions.empty() && begin <= pinned.regions.back().offset + pinned.regions.back().data.size()) {
+            // overlaps the previous region, extend it instead
+            auto& last = pinned.regions.back();
+            begin = last.offset + last.data.size();
+            if (end <= begin) {
+                return true;
+            }
+            auto size = last.data.size();
+            last.data.resize(size + end - begin);
+            auto bytes = read_plot(nullptr, open_plot, reinterpret_cast<char*>(last.data.data() + size), end - begin, begin, false);
+            return bytes == static_cast<int>(end - begin);
+        }
+        PinnedPlot::Region region { begin, std::vector<uint8_t>(end - begin) };
+        auto bytes = read_plot(nullptr, open_plot, reinterpret_cast<char*>(region.data.data()), region.data.size(), begin, false);
+        if (bytes != static_cast<int>(region.data.size())) {
+            return false;
+        }
+        pinned.regions.push_back(std::move(region));
+        return true;
+    }
+
+    void load()
+    {
+        const auto& plot = *open_plot.plot;
+        auto pinned = std::make_shared<PinnedPlot>();
+        // plots added by older versions have no header in the geometry
+        std::vector<uint8_t> data(plot.header, plot.header + plot.header_size);
+        auto bytes = static_cast<int>(data.size());
+        if (!plot.header) {
+            data.resize(std::min(static_cast<uint64_t>(PlotHeader::read_size), plot.size));
+            bytes = read_plot(nullptr, open_plot, reinterpret_cast<char*>(data.data()), data.size(), 0, false);
+            if (bytes < 0) {
+                pin_cache->abandon(plot.id);
+                return;
+            }
+        }
+        PlotHeader header;
+        if (PlotHeader::parse(data.data(), bytes, header) && header.has_tables) {
+            auto c1 = header.tables[PlotHeader::C1], c3 = header.tables[PlotHeader::C3];
+            // C1 and C2 are adjacent, C3 starts right after C2
+            if (c1 <= header.tables[PlotHeader::C2] && header.tables[PlotHeader::C2] <= c3 && c3 <= plot.size && c3 - c1 <= pin_cache->capacity()) {
+                if (!add(*pinned, 0, header.size) || !add(*pinned, c1, c3)) {
+                    pin_cache->abandon(plot.id);
+                    return;
+                }
+            }
+        }
+        pin_cache->insert(plot.id, pinned);
+    }
+
+    static void run(void* arg)
+    {
+        auto load = static_cast<PinLoad*>(arg);
+        load->load();
+        delete load;
+    }
+};
+
+static void pin_plot(std::shared_ptr<const ReadView> snapshot, const PlotCatalog::Entry* plot)
+{
+    auto load = new PinLoad();
+    load->open_plot.snapshot = std::move(snapshot);
+    load->open_plot.plot = plot;
+    pin_loader->post(WorkerPool::Job { PinLoad::run, load });
+}
+
+// Replies with one fd backed buffer per segment so the kernel can splice the
+// data straight from the devices without copying it through userspace. Returns
+// false if the read should be done synchronously instead, which is also how
+// tripped devices get probed and failed.
+static bool read_splice(fuse_req_t req, const OpenPlot& open_plot, size_t size, off_t offset, bool streaming)
+{
+    static thread_local std::vector<Segment> segments;
+    static thread_local std::vector<char> storage;
+    segments.clear();
+    auto ok = for_each_segment(open_plot, offset, size, [&](const Segment& segment) {
+        if (!segment.device->handle || !segment.device->health->healthy()) {
+            return false;
+        }
+        segments.push_back(segment);
+        return true;
+    });
+    if (!ok) {
+        return false;
+    }
+    if (segments.empty()) {
+        fuse_reply_buf(req, nullptr, 0);
+        return true;
+    }
+
+    // fuse_bufvec ends in a one element array that is allocated past its end
+    storage.resize(sizeof(struct fuse_bufvec) + (segments.size() - 1) * sizeof(struct fuse_buf));
+    auto bufv = reinterpret_cast<struct fuse_bufvec*>(storage.data());
+    memset(bufv, 0, storage.size());
+    bufv->count = segments.size();
+    for (size_t i = 0; i < segments.size(); ++i) {
+        bufv->buf[i].size = segments[i].size;
+        bufv->buf[i].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        bufv->buf[i].fd = segments[i].device->fd(streaming)->fd();
+        bufv->buf[i].pos = segments[i].offset;
+    }
+    // the devices are read while replying, so a device that stops answering
+    // holds this thread and must count as a stuck read to be tripped
+    for (const auto& segment : segments) {
+        segment.device->health->begin();
+    }
+    auto ret = fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    for (const auto& segment : segments) {
+        segment.device->health->end(ret == 0);
+    }
+    return true;
+}
+
+// Replies to a read that was split into segments, with the bytes up to the first
+// short segment, or EIO if any segment failed. Same semantics as read_plot().
+template <typename T>
+static void reply_segments(fuse_req_t req, const char* buffer, const T* segments, size_t count)
+{
+    if (fuse_req_interrupted(req)) {
+        fuse_reply_err(req, EINTR);
+        return;
+    }
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (segments[i].result < 0) {
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        bytes += segments[i].result;
+        if (static_cast<size_t>(segments[i].result) < segments[i].size) {
+            break;
+        }
+    }
+    fuse_reply_buf(req, buffer, bytes);
+}
+
+// A FUSE read queued on the device schedulers. It is replied by whichever
+// thread completes its last request.
+struct ScheduledRead {
+    fuse_req_t req;
+    std::shared_ptr<const ReadView> snapshot;
+    std::vector<char> buffer;
+    std::vector<IoScheduler::Request> parts;
+    std::vector<const PooledDevice*> devices; // one per part
+    std::atomic<size_t> pending { 0 };
+};
+
+// pooled so the buffers are reused
+static ObjectPool<ScheduledRead> scheduled_reads;
+
+static void scheduled_done(IoScheduler::Request* r)
+{
+    auto read = static_cast<ScheduledRead*>(r->user);
+    read->devices[r - read->parts.data()]->health->end(r->result >= 0);
+    if (--read->pending > 0) {
+        return;
+    }
+    reply_segments(read->req, read->buffer.data(), read->parts.data(), read->parts.size());
+    read->snapshot.reset();
+    scheduled_reads.release(read);
+}
+
+// Queues the read on the schedulers of its devices and dispatches what it can.
+// Returns false if the read should be done synchronously instead.
+static bool read_scheduled(fuse_req_t req, const OpenPlot& open_plot, size_t size, off_t offset)
+{
+    if (options.queue_depth == 0) {
+        return false;
+    }
+    static thread_local std::vector<Segment> segments;
+    segments.clear();
+    auto ok = for_each_segment(open_plot, offset, size, [&](const Segment& segment) {
+        if (!segment.device->scheduler) {
+            return false;
+        }
+        if (!segment.device->health->healthy()) {
+            // reads queued behind a hung one would never be answered
+            segment.device->scheduler->fail_queued();
+            return false;
+        }
+        segments.push_back(segment);
+        return true;
+    });
+    if (!ok || segments.empty()) {
+        return false;
+    }
+
+    // the read may be replied and freed as soon as it is submitted, hold on to
+    // what is needed to run the queues
+    auto snapshot = open_plot.snapshot;
+    auto read = scheduled_reads.acquire();
+    read->req = req;
+    read->snapshot = snapshot;
+    if (read->buffer.size() < size) {
+        read->buffer.resize(size);
+    }
+    read->parts.resize(segments.size());
+    read->devices.resize(segments.size());
+    read->pending = segments.size();
+    auto data = reinterpret_cast<uint8_t*>(read->buffer.data());
+    for (size_t i = 0; i < segments.size(); ++i) {
+        read->parts[i] = IoScheduler::Request { segments[i].offset, segments[i].size, data, 0, scheduled_done, read };
+        read->devices[i] = segments[i].device;
+        data += segments[i].size;
+    }
+    for (size_t i = 0; i < segments.size(); ++i) {
+        segments[i].device->health->begin();
+        segments[i].device->scheduler->submit(&read->parts[i]);
+    }
+    for (size_t i = 0; i < segments.size(); ++i) {
+        segments[i].device->scheduler->run();
+    }
+    return true;
+}
+
+#ifdef PLOTFS_HAVE_IO_URING
+static const size_t uring_max_segments = 8;
+
+// A FUSE read in flight on io_uring. It is replied from the completion thread
+// once all of its segments finished.
+struct UringRead {
+    struct Op {
+        UringRead* read;
+        const PooledDevice* device;
+        size_t size;
+        int result;
+    };
+
+    fuse_req_t req;
+    std::shared_ptr<const ReadView> snapshot; // keeps the registered files open
+    int buffer;
+    size_t count = 0;
+    std::atomic<size_t> pending { 0 };
+    Op ops[uring_max_segments];
+};
+
+static ObjectPool<UringRead> uring_reads;
+
+static void uring_complete(void* user, int result)
+{
+    auto op = static_cast<UringRead::Op*>(user);
+    auto read = op->read;
+    op->result = result;
+    op->device->health->end(result >= 0);
+    if (--read->pending > 0) {
+        return;
+    }
+
+    reply_segments(read->req, reinterpret_cast<const char*>(uring->buffer(read->buffer)), read->ops, read->count);
+    uring->release_buffer(read->buffer);
+    read->snapshot.reset();
+    uring_reads.release(read);
+}
+
+// Submits the read to io_uring and returns without waiting. Returns false if the
+// read can not be handled asynchronously and should be done synchronously.
+static bool read_uring(fuse_req_t req, const OpenPlot& open_plot, size_t size, off_t offset)
+{
+    if (!uring || size > uring->buffer_size()) {
+        return false;
+    }
+    auto buffer = uring->acquire_buffer();
+    if (buffer < 0) {
+        return false;
+    }
+
+    UringEngine::Read reads[uring_max_segments];
+    auto read = uring_reads.acquire();
+    read->req = req;
+    read->snapshot = open_plot.snapshot;
+    read->buffer = buffer;
+    read->count = 0;
+    auto data = uring->buffer(buffer);
+    auto ok = for_each_segment(open_plot, offset, size, [&](const Segment& segment) {
+        if (read->count == uring_max_segments || segment.device->uring_file < 0 || !segment.device->health->healthy()) {
+            return false;
+        }
+        read->ops[read->count] = UringRead::Op { read, segment.device, segment.size, 0 };
+        reads[read->count] = UringEngine::Read { segment.device->uring_file, buffer, data, segment.size, segment.offset, &read->ops[read->count] };
+        data += segment.size, read->count++;
+        return true;
+    });
+    if (!ok || read->count == 0) {
+        uring->release_buffer(buffer);
+        read->snapshot.reset();
+        uring_reads.release(read);
+        return false;
+    }
+    read->pending = read->count;
+    for (size_t i = 0; i < read->count; ++i) {
+        read->ops[i].device->health->begin();
+    }
+    // reads that outlive the deadline are cancelled and count as errors
+    uring->submit(reads, read->count, options.read_timeout);
+    return true;
+}
+#endif
+
+// Asks the kernel to start reading the next --readahead window of a streamed
+// plot, following the plot across shard and device boundaries
+static void prefetch(const OpenPlot& open_plot, uint64_t offset)
+{
+    uint64_t window = options.readahead * 1024ull;
+    auto& prefetched = open_plot.pattern.prefetched;
+    auto begin = std::max(prefetched.load(), offset);
+    // wait until half of the window was consumed before issuing the next one
+    if (begin > offset + window / 2) {
+        return;
+    }
+    auto end = offset + window;
+    prefetched = end;
+    for_each_segment(open_plot, begin, end - begin, [](const Segment& segment) {
+        // devices that failed to open have no descriptor to advise
+        if (segment.device->handle && segment.device->health->healthy()) {
+            // may block while the kernel queues the reads
+            auto& health = *segment.device->health;
+            health.begin();
+            health.end(segment.device->fd(true)->advise(segment.offset, segment.size, POSIX_FADV_WILLNEED));
+        }
+        return true;
+    });
+}
+
+// Answers a read of an open plot, from the pin cache, asynchronously on one of the
+// queues, or synchronously on the calling thread
+static void reply_read(fuse_req_t req, const OpenPlot& open_plot, size_t size, off_t offset)
+{
+    if (open_plot.pinned) {
+        auto data = open_plot.pinned->find(offset, size);
+        if (data) {
+            fuse_reply_buf(req, reinterpret_cast<const char*>(data), size);
+            return;
+        }
+    }
+    auto streaming = false;
+    if (options.readahead && !options.direct) {
+        streaming = open_plot.pattern.record(offset, size);
+        if (streaming) {
+            prefetch(open_plot, offset + size);
+        }
+    }
+    // the caches sit on the synchronous path, streams bypass them
+    auto cached = (block_cache || cache_device) && !streaming;
+#ifdef PLOTFS_HAVE_IO_URING
+    if (!cached && read_uring(req, open_plot, size, offset)) {
+        return;
+    }
+#endif
+    if (!cached && read_scheduled(req, open_plot, size, offset)) {
+        return;
+    }
+    if (!cached && options.splice && !options.direct && read_splice(req, open_plot, size, offset, streaming)) {
+        return;
+    }
+
+    // one buffer per worker thread, sized for the largest request seen
+    static thread_local std::vector<char> buf;
+    if (buf.size() < size) {
+        buf.resize(size);
+    }
+    auto bytes = read_plot(req, open_plot, buf.data(), size, offset, streaming);
+    if (bytes < 0) {
+        fuse_reply_err(req, -bytes);
+        return;
+    }
+    fuse_reply_buf(req, buf.data(), bytes);
+}
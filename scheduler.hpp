@@ -0,0 +1,118 @@
+#pragma once
+
+#include "file.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+// Per device request queue. At most depth requests are in flight on the device
+// at once, the rest wait sorted by physical offset and are dispatched in one
+// direction sweeps (C-SCAN). Requests that are adjacent on disk are merged into
+// a single preadv.
+class IoScheduler {
+public:
+    struct Request {
+        uint64_t offset;
+        size_t size;
+        uint8_t* data;
+        int result; // bytes read or -1, set before done is called
+        void (*done)(Request*);
+        void* user;
+    };
+
+private:
+    std::shared_ptr<FileHandle> handle;
+    unsigned depth;
+    size_t max_merge;
+
+    std::mutex m;
+    std::vector<Request*> queue; // sorted by offset, keeps its capacity so queuing does not allocate once warm
+    unsigned inflight = 0;
+    uint64_t head = 0; // where the last dispatch ended
+
+public:
+    IoScheduler(std::shared_ptr<FileHandle> handle, unsigned depth, size_t max_merge = 1024 * 1024)
+        : handle(handle)
+        , depth(depth)
+        , max_merge(max_merge) {};
+
+    void submit(Request* r)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        // after requests at the same offset, in submission order
+        auto it = std::upper_bound(queue.begin(), queue.end(), r->offset, [](uint64_t offset, const Request* q) { return offset < q->offset; });
+        queue.insert(it, r);
+    }
+
+    // Completes every request still waiting with an error. Used once the device
+    // stopped responding, since the reads ahead of them may never finish.
+    void fail_queued()
+    {
+        static thread_local std::vector<Request*> failed;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            failed.assign(queue.begin(), queue.end());
+            queue.clear();
+        }
+        for (auto r : failed) {
+            r->result = -1;
+            r->done(r); // may free r
+        }
+    }
+
+    // Dispatches queued requests on the calling thread until the queue is empty
+    // or the device has depth requests in flight. Requests submitted by other
+    // threads may be completed here, and the caller's own requests may be left
+    // for whichever thread finishes its dispatch next.
+    void run()
+    {
+        // scratch space reused across calls, run() may be entered by several threads
+        static thread_local std::vector<Request*> batch;
+        static thread_local std::vector<struct iovec> iov;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if (queue.empty() || inflight >= depth) {
+                    return;
+                }
+                auto it = std::lower_bound(queue.begin(), queue.end(), head, [](const Request* q, uint64_t offset) { return q->offset < offset; });
+                if (it == queue.end()) {
+                    it = queue.begin();
+                }
+                batch.clear();
+                auto first = it;
+                auto end = (*it)->offset;
+                size_t total = 0;
+                while (it != queue.end() && (*it)->offset == end && (batch.empty() || total + (*it)->size <= max_merge)) {
+                    batch.push_back(*it);
+                    end += (*it)->size, total += (*it)->size;
+                    ++it;
+                }
+                queue.erase(first, it);
+                head = end;
+                ++inflight;
+            }
+
+            iov.clear();
+            for (auto r : batch) {
+                iov.push_back({ r->data, r->size });
+            }
+            auto bytes = handle->preadv(iov.data(), iov.size(), batch.front()->offset);
+
+            {
+                std::lock_guard<std::mutex> lock(m);
+                --inflight;
+            }
+            for (auto r : batch) {
+                if (bytes < 0) {
+                    r->result = -1;
+                } else {
+                    r->result = std::min(static_cast<size_t>(bytes), r->size);
+                    bytes -= r->result;
+                }
+                r->done(r); // may free r
+            }
+        }
+    }
+};
@@ -0,0 +1,268 @@
+// Checks that a warm open/read/release cycle of mount.plotfs does not touch the
+// heap. The cycle runs the read path from readpath.hpp, against two scratch
+// files standing in for devices, once for every way a read can go: plain
+// positional reads with stripe workers, the --queue_depth scheduler, splice,
+// --readahead streaming, the block cache and O_DIRECT. tests/fuse3 stands in
+// for libfuse, and the replies are checked against the data on the devices.
+
+#include "readpath.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<bool> counting { false };
+static std::atomic<size_t> allocations { 0 };
+
+// GCC pairs the malloc below with the replaced operator delete across inlining
+// and warns, the pairing is what replacing both is for
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void* operator new(size_t size)
+{
+    if (counting) {
+        ++allocations;
+    }
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+// A request and the reply it got, reused for every read
+struct fuse_req {
+    static const size_t capacity = 1024 * 1024;
+    std::unique_ptr<char[]> data { new char[capacity] };
+    size_t size = 0;
+    int error = 0;
+    bool replied = false;
+};
+
+int fuse_req_interrupted(fuse_req_t) { return 0; }
+
+int fuse_reply_err(fuse_req_t req, int err)
+{
+    req->error = err, req->replied = true;
+    return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char* buf, size_t size)
+{
+    std::memcpy(req->data.get(), buf, size);
+    req->size = size, req->replied = true;
+    return 0;
+}
+
+// What the kernel does with a spliced reply, minus the pipe
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec* bufv, enum fuse_buf_copy_flags)
+{
+    req->size = 0;
+    for (size_t i = 0; i < bufv->count; ++i) {
+        const auto& b = bufv->buf[i];
+        if (static_cast<ssize_t>(b.size) != ::pread(b.fd, req->data.get() + req->size, b.size, b.pos)) {
+            return fuse_reply_err(req, EIO);
+        }
+        req->size += b.size;
+    }
+    req->replied = true;
+    return 0;
+}
+
+static const uint64_t device_size = 8 * 1024 * 1024;
+
+// The byte at offset of a scratch device, different for every offset in a page
+static uint8_t pattern(uint32_t device, uint64_t offset)
+{
+    return static_cast<uint8_t>((offset * 7) ^ (offset >> 9) ^ (device * 0x5b));
+}
+
+// Where the plots live, kept apart from the catalog so the replies are checked
+// against an independent copy of the layout
+struct Shard {
+    uint32_t device;
+    uint64_t begin;
+    uint64_t size;
+};
+static const std::vector<std::vector<Shard>> layout = {
+    { { 0, 64, 3 * 1024 * 1024 } }, // a single shard
+    { { 0, 3 * 1024 * 1024 + 128, 1024 * 1024 + 4000 }, { 1, 64, 2 * 1024 * 1024 } }, // straddles both devices
+};
+
+// The contents of each plot, put together from the layout
+static std::vector<std::vector<uint8_t>> contents;
+
+static bool check(const fuse_req& req, size_t plot, uint64_t offset, size_t size)
+{
+    if (!req.replied || req.error || req.size != size) {
+        std::cerr << "read of " << size << " bytes at " << offset << " of plot " << plot << " got " << req.size << " bytes, error " << req.error << std::endl;
+        return false;
+    }
+    if (0 != std::memcmp(req.data.get(), contents[plot].data() + offset, size)) {
+        std::cerr << "wrong data in the read at " << offset << " of plot " << plot << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// The snapshot the plots are opened from, set up the way mount.plotfs does
+static std::shared_ptr<const ReadView> make_view(const std::vector<std::string>& paths)
+{
+    auto view = std::make_shared<ReadView>();
+    for (uint32_t d = 0; d < paths.size(); ++d) {
+        auto device = std::make_shared<PooledDevice>();
+        device->path = paths[d];
+        device->health = std::make_unique<DeviceHealth>(device->path, options.read_timeout);
+        device->cache_id = d + 1;
+        device->handle = FileHandle::open(device->path);
+        if (options.direct) {
+            device->direct = FileHandle::open(device->path, O_RDONLY | O_DIRECT);
+        }
+        if (options.readahead) {
+            device->sequential = FileHandle::open(device->path);
+        }
+        if (options.queue_depth) {
+            device->scheduler = std::make_unique<IoScheduler>(device->handle, options.queue_depth);
+        }
+        view->devices.push_back(device);
+    }
+    for (size_t p = 0; p < layout.size(); ++p) {
+        PlotCatalog::Entry entry;
+        entry.id.fill(0);
+        entry.id[0] = p + 1;
+        entry.k = 32;
+        view->catalog.add_plot(entry);
+        for (const auto& shard : layout[p]) {
+            view->catalog.add_shard(shard.begin, shard.size, shard.device);
+        }
+    }
+    view->catalog.index();
+    return view;
+}
+
+// Opens a plot, reads it and releases it, the way a harvester looks up a proof.
+// Streams read on from where the previous cycle of the plot stopped.
+static bool cycle(const std::shared_ptr<const ReadView>& view, fuse_req& req, uint64_t i, bool stream)
+{
+    static uint64_t next[2] = { 0, 0 };
+    auto p = i % layout.size();
+    const auto& plot = view->catalog.plots()[p];
+    auto open_plot = acquire_open_plot(view, &plot);
+
+    const size_t size = 128 * 1024;
+    for (int r = 0; r < 8; ++r) {
+        uint64_t offset;
+        if (stream) {
+            offset = next[p] + size > plot.size ? 0 : next[p];
+            next[p] = offset + size;
+        } else {
+            offset = (i * 7919 + r * 104729) * 4093 % (plot.size - size);
+        }
+        req.replied = false, req.error = 0, req.size = 0;
+        reply_read(&req, *open_plot, size, offset);
+        if (!check(req, p, offset, size)) {
+            return false;
+        }
+    }
+
+    release_open_plot(open_plot);
+    return true;
+}
+
+static bool run(const char* name, const std::vector<std::string>& paths, bool stream)
+{
+    auto view = make_view(paths);
+    fuse_req req;
+    for (uint64_t i = 0; i < 200; ++i) {
+        if (!cycle(view, req, i, stream)) {
+            return false;
+        }
+    }
+
+    allocations = 0;
+    counting = true;
+    auto ok = true;
+    for (uint64_t i = 0; i < 1000 && ok; ++i) {
+        ok = cycle(view, req, i * 31, stream);
+    }
+    counting = false;
+    if (!ok) {
+        return false;
+    }
+    if (allocations != 0) {
+        std::cerr << name << ": " << allocations << " allocations in 1000 warm cycles" << std::endl;
+        return false;
+    }
+    std::cout << name << ": no allocations in 1000 warm cycles" << std::endl;
+    return true;
+}
+
+int main()
+{
+    std::vector<std::string> paths;
+    for (uint32_t d = 0; d < 2; ++d) {
+        char path[] = "/tmp/plotfs_alloc_test.XXXXXX";
+        auto fd = ::mkstemp(path);
+        if (fd < 0) {
+            std::cerr << "mkstemp failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+        FileHandle file(fd);
+        std::vector<uint8_t> data(device_size);
+        for (uint64_t i = 0; i < data.size(); ++i) {
+            data[i] = pattern(d, i);
+        }
+        if (file.write(data.data(), data.size()) != static_cast<int>(data.size())) {
+            std::cerr << "failed to write test file" << std::endl;
+            return EXIT_FAILURE;
+        }
+        paths.push_back(path);
+    }
+
+    for (const auto& shards : layout) {
+        contents.emplace_back();
+        for (const auto& shard : shards) {
+            for (uint64_t i = 0; i < shard.size; ++i) {
+                contents.back().push_back(pattern(shard.device, shard.begin + i));
+            }
+        }
+    }
+
+    auto ok = true;
+    options.read_timeout = 5000;
+    stripe_workers = std::make_unique<WorkerPool>(2);
+    ok &= run("synchronous", paths, false);
+
+    options.queue_depth = 4;
+    ok &= run("queue_depth", paths, false);
+    options.queue_depth = 0;
+
+    options.splice = 1;
+    ok &= run("splice", paths, false);
+    options.splice = 0;
+
+    options.readahead = 1024;
+    ok &= run("readahead", paths, true);
+    options.readahead = 0;
+
+    // small enough that lookups keep evicting blocks
+    block_cache = std::make_unique<BlockCache>(4 * 1024 * 1024);
+    ok &= run("block_cache", paths, false);
+    block_cache.reset();
+
+    auto direct = FileHandle::open(paths[0], O_RDONLY | O_DIRECT);
+    if (direct) {
+        options.direct = 1;
+        direct_buffers = std::make_unique<AlignedBufferPool>(4, 1024 * 1024 + 2 * AlignedBufferPool::alignment, false);
+        ok &= run("direct", paths, false);
+        options.direct = 0;
+    } else {
+        std::cout << "direct: skipped, " << paths[0] << " does not support O_DIRECT" << std::endl;
+    }
+
+    for (const auto& path : paths) {
+        ::unlink(path.c_str());
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,175 @@
+// Replays device reads against the --block_cache of mount.plotfs at several
+// sizes and reports how many hit, next to a plain LRU of the same size. The
+// reads come from a trace file or, by default, from a synthetic farm where
+// proof lookups keep returning to a hot set while a `chia plots check` sweep
+// reads a much larger range once:
+//
+//   cache_bench --sizes=64,256,1024
+//   cache_bench --trace=reads.txt --sizes=512,2048
+//
+// A trace has one read per line, `device offset size`, with the offset and size
+// in bytes. Built with -DPLOTFS_BENCHMARKS=ON, not run by ctest.
+
+#include "blockcache.hpp"
+
+#include "CLI11.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <random>
+#include <unordered_map>
+
+struct Read {
+    uint32_t device;
+    uint64_t offset;
+    uint32_t size;
+    bool lookup; // false for the sweep
+};
+
+// What mount.plotfs would do without a replacement policy of its own
+class LruCache {
+private:
+    size_t capacity;
+    std::list<uint64_t> order; // most recent first
+    std::unordered_map<uint64_t, std::list<uint64_t>::iterator> blocks;
+
+public:
+    explicit LruCache(size_t bytes)
+        : capacity(std::max<size_t>(1, bytes / BlockCache::block_size))
+    {
+    }
+
+    // Returns true on a hit, caches the block on a miss
+    bool access(uint64_t block)
+    {
+        auto it = blocks.find(block);
+        if (it != blocks.end()) {
+            order.splice(order.begin(), order, it->second);
+            return true;
+        }
+        if (blocks.size() >= capacity) {
+            blocks.erase(order.back());
+            order.pop_back();
+        }
+        order.push_front(block);
+        blocks.emplace(block, order.begin());
+        return false;
+    }
+};
+
+// Lookups spread over hot_mib of two plots, a sweep through sweep_mib of a
+// third one on another device spread over the same time
+static std::vector<Read> synthetic_trace(uint64_t hot_mib, uint64_t sweep_mib, size_t lookups)
+{
+    std::vector<Read> reads;
+    std::mt19937_64 random(1);
+    const uint64_t hot = hot_mib * 1024 * 1024, sweep = sweep_mib * 1024 * 1024;
+    const uint32_t sweep_read = 1024 * 1024;
+    auto sweeps = sweep / sweep_read;
+    uint64_t swept = 0;
+    for (size_t i = 0; i < lookups; ++i) {
+        // proof lookups are small, and often several land in the same block
+        uint32_t device = random() % 2;
+        uint32_t size = 64 << (random() % 8);
+        reads.push_back(Read { device, random() % (hot / 2 - size), size, true });
+        while (swept < sweeps && swept * lookups < (i + 1) * sweeps) {
+            reads.push_back(Read { 2, swept * sweep_read, sweep_read, false });
+            ++swept;
+        }
+    }
+    return reads;
+}
+
+static bool load_trace(const std::string& path, std::vector<Read>& reads)
+{
+    std::ifstream trace(path);
+    if (!trace) {
+        std::cerr << "failed to open " << path << std::endl;
+        return false;
+    }
+    Read read { 0, 0, 0, true };
+    while (trace >> read.device >> read.offset >> read.size) {
+        reads.push_back(read);
+    }
+    if (!trace.eof()) {
+        std::cerr << "bad line " << reads.size() + 1 << " in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+struct Ratio {
+    uint64_t hits = 0;
+    uint64_t total = 0;
+    void add(bool hit) { hits += hit, ++total; }
+    double percent() const { return total ? 100.0 * hits / total : 0; }
+};
+
+// Goes through the reads block by block, the way read_cached does
+static void replay(const std::vector<Read>& reads, size_t bytes)
+{
+    const auto block_size = BlockCache::block_size;
+    static uint8_t block[block_size];
+    BlockCache cache(bytes);
+    LruCache lru(bytes);
+    Ratio cache_all, cache_lookups, lru_all, lru_lookups;
+    for (const auto& read : reads) {
+        for (auto position = read.offset; position < read.offset + read.size;) {
+            auto within = position % block_size;
+            auto chunk = std::min<uint64_t>(read.offset + read.size - position, block_size - within);
+            auto key = BlockCache::key(read.device, position / block_size, 0);
+            auto hit = cache.get(key, within, chunk, block);
+            if (!hit) {
+                cache.put(key, block, block_size);
+            }
+            cache_all.add(hit);
+            auto lru_hit = lru.access(key.block);
+            lru_all.add(lru_hit);
+            if (read.lookup) {
+                cache_lookups.add(hit);
+                lru_lookups.add(lru_hit);
+            }
+            position += chunk;
+        }
+    }
+    std::cout << bytes / 1024 / 1024 << " MiB: block cache " << cache_all.percent() << "% of block reads hit, "
+              << cache_lookups.percent() << "% of lookups; LRU " << lru_all.percent() << "%, " << lru_lookups.percent()
+              << "%" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app { "Block cache benchmark for mount.plotfs" };
+
+    std::vector<uint64_t> sizes { 64, 256, 1024 };
+    app.add_option("--sizes", sizes, "Cache sizes to replay against, in MiB")->delimiter(',');
+
+    std::string trace;
+    app.add_option("--trace", trace, "Reads to replay, one `device offset size` per line");
+
+    uint64_t hot = 512, sweep = 16 * 1024;
+    size_t lookups = 1000000;
+    app.add_option("--hot", hot, "MiB the synthetic lookups are spread over");
+    app.add_option("--sweep", sweep, "MiB read by the synthetic sweep");
+    app.add_option("--lookups", lookups, "Number of synthetic lookups");
+    CLI11_PARSE(app, argc, argv);
+
+    std::vector<Read> reads;
+    if (!trace.empty()) {
+        if (!load_trace(trace, reads)) {
+            return EXIT_FAILURE;
+        }
+    } else if (hot > 0 && lookups > 0) {
+        reads = synthetic_trace(hot, sweep, lookups);
+    }
+    if (reads.empty()) {
+        std::cerr << "no reads to replay" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for (auto size : sizes) {
+        replay(reads, size * 1024 * 1024);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// Just enough of libfuse's low-level API for readpath.hpp, so that tests can
+// drive the read path without libfuse or a mount. Tests implement the reply
+// functions. Declarations match fuse_lowlevel.h and fuse_common.h of libfuse 3.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct fuse_req* fuse_req_t;
+typedef uint64_t fuse_ino_t;
+
+enum fuse_buf_flags {
+    FUSE_BUF_IS_FD = (1 << 1),
+    FUSE_BUF_FD_SEEK = (1 << 2),
+    FUSE_BUF_FD_RETRY = (1 << 3),
+};
+
+enum fuse_buf_copy_flags {
+    FUSE_BUF_NO_SPLICE = (1 << 1),
+    FUSE_BUF_FORCE_SPLICE = (1 << 2),
+    FUSE_BUF_SPLICE_MOVE = (1 << 3),
+    FUSE_BUF_SPLICE_NONBLOCK = (1 << 4),
+};
+
+struct fuse_buf {
+    size_t size;
+    enum fuse_buf_flags flags;
+    void* mem;
+    int fd;
+    off_t pos;
+};
+
+struct fuse_bufvec {
+    size_t count;
+    size_t idx;
+    size_t off;
+    struct fuse_buf buf[1];
+};
+
+int fuse_req_interrupted(fuse_req_t req);
+int fuse_reply_err(fuse_req_t req, int err);
+int fuse_reply_buf(fuse_req_t req, const char* buf, size_t size);
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec* bufv, enum fuse_buf_copy_flags flags);
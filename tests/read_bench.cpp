@@ -0,0 +1,288 @@
+// Reads plots through a mounted plotfs and reports how long it took. Run it
+// against the same farm mounted with different options to compare them:
+//
+//   read_bench --header /farm      with and without --kernel_cache
+//   read_bench --stream --pid=$(pidof mount.plotfs) /farm
+//                                  with and without --splice
+//   read_bench --random --threads=32 /farm
+//                                  with and without --io_uring
+//   read_bench --random --pid=$(pidof mount.plotfs) /farm
+//                                  with and without --direct
+//
+// Built with -DPLOTFS_BENCHMARKS=ON, not run by ctest.
+
+#include "file.hpp"
+
+#include "CLI11.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <dirent.h>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ms(Clock::time_point since)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - since).count();
+}
+
+// CPU seconds used by a process so far, user and system time combined, or by
+// this process if pid is 0
+static double cpu_seconds(pid_t pid)
+{
+    if (pid == 0) {
+        struct rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line) || line.rfind(')') == std::string::npos) {
+        return 0;
+    }
+    // the command name may hold spaces, the fields after it do not
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14) {
+            utime = std::stoul(field);
+        } else if (i == 15) {
+            stime = std::stoul(field);
+        }
+    }
+    return static_cast<double>(utime + stime) / ::sysconf(_SC_CLK_TCK);
+}
+
+// A field of /proc/<pid>/status or /proc/meminfo in KiB, such as VmRSS or Cached
+static uint64_t proc_kib(const std::string& path, const std::string& name)
+{
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (0 == line.compare(0, name.size() + 1, name + ":")) {
+            return std::stoull(line.substr(name.size() + 1));
+        }
+    }
+    return 0;
+}
+
+// Memory used by mount.plotfs and by the page cache, before and after a run
+struct Memory {
+    uint64_t rss; // KiB, of mount.plotfs
+    uint64_t cached; // KiB, page cache of the whole system
+
+    static Memory sample(pid_t pid)
+    {
+        return Memory { pid ? proc_kib("/proc/" + std::to_string(pid) + "/status", "VmRSS") : 0, proc_kib("/proc/meminfo", "Cached") };
+    }
+
+    void report(pid_t pid) const
+    {
+        auto after = sample(pid);
+        if (pid) {
+            std::cout << "mount.plotfs RSS: " << rss / 1024 << " MiB before, " << after.rss / 1024 << " MiB after" << std::endl;
+        }
+        std::cout << "page cache grew by " << (static_cast<int64_t>(after.cached) - static_cast<int64_t>(cached)) / 1024 << " MiB" << std::endl;
+    }
+};
+
+// The plots in a directory, or the file itself
+static std::vector<std::string> find_plots(const std::string& path)
+{
+    std::vector<std::string> plots;
+    auto dir = ::opendir(path.c_str());
+    if (!dir) {
+        plots.push_back(path);
+        return plots;
+    }
+    while (auto entry = ::readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > 5 && 0 == name.compare(name.size() - 5, 5, ".plot")) {
+            plots.push_back(path + "/" + name);
+        }
+    }
+    ::closedir(dir);
+    std::sort(plots.begin(), plots.end());
+    return plots;
+}
+
+// What a harvester does when it starts: open every plot and read its header.
+// The first round reaches the disks, later rounds show what the kernel cached.
+static bool bench_headers(const std::vector<std::string>& plots, size_t size, unsigned rounds)
+{
+    std::vector<uint8_t> buffer(size);
+    for (unsigned round = 1; round <= rounds; ++round) {
+        auto start = Clock::now();
+        for (const auto& path : plots) {
+            auto file = FileHandle::open(path);
+            if (!file || 0 > file->pread(buffer.data(), buffer.size(), 0)) {
+                std::cerr << "failed to read " << path << std::endl;
+                return false;
+            }
+        }
+        auto ms = elapsed_ms(start);
+        std::cout << "round " << round << ": " << plots.size() << " headers in " << ms << " ms, "
+                  << ms * 1000 / plots.size() << " us per plot" << std::endl;
+    }
+    return true;
+}
+
+// Reads plots from start to end, as `chia plots check` or copying them off the
+// farm does, and reports the CPU time spent per GB by mount.plotfs and by the
+// reader. The page cache is dropped for each plot first so the data comes from
+// the devices.
+static bool bench_stream(const std::vector<std::string>& plots, size_t size, uint64_t limit, pid_t pid)
+{
+    std::vector<uint8_t> buffer(size);
+    uint64_t total = 0;
+    auto start = Clock::now();
+    auto mount_cpu = cpu_seconds(pid), own_cpu = cpu_seconds(0);
+    auto memory = Memory::sample(pid);
+    for (const auto& path : plots) {
+        auto file = FileHandle::open(path);
+        if (!file) {
+            std::cerr << "failed to open " << path << std::endl;
+            return false;
+        }
+        file->advise(0, 0, POSIX_FADV_DONTNEED);
+        for (uint64_t offset = 0; total < limit; offset += buffer.size()) {
+            auto bytes = file->pread(buffer.data(), buffer.size(), offset);
+            if (bytes < 0) {
+                std::cerr << "failed to read " << path << std::endl;
+                return false;
+            }
+            total += bytes;
+            if (static_cast<size_t>(bytes) < buffer.size()) {
+                break;
+            }
+        }
+    }
+    auto seconds = elapsed_ms(start) / 1000;
+    auto gb = total / 1e9;
+    std::cout << "read " << gb << " GB in " << seconds << " s, " << gb * 1000 / seconds << " MB/s" << std::endl;
+    if (pid) {
+        std::cout << "mount.plotfs: " << (cpu_seconds(pid) - mount_cpu) / gb << " CPU s per GB" << std::endl;
+    }
+    std::cout << "reader: " << (cpu_seconds(0) - own_cpu) / gb << " CPU s per GB" << std::endl;
+    memory.report(pid);
+    return total > 0;
+}
+
+// Proof lookups: small reads at random offsets of random plots, issued by
+// several threads at once. Reports throughput and the latency distribution.
+static bool bench_random(const std::vector<std::string>& plots, size_t size, unsigned threads, unsigned count, pid_t pid)
+{
+    struct Plot {
+        std::shared_ptr<FileHandle> file;
+        uint64_t size;
+    };
+    std::vector<Plot> files;
+    for (const auto& path : plots) {
+        auto file = FileHandle::open(path);
+        struct stat st;
+        if (!file || 0 != ::fstat(file->fd(), &st)) {
+            std::cerr << "failed to open " << path << std::endl;
+            return false;
+        }
+        if (static_cast<uint64_t>(st.st_size) >= size) {
+            files.push_back(Plot { file, static_cast<uint64_t>(st.st_size) });
+        }
+    }
+    if (files.empty()) {
+        std::cerr << "all plots are smaller than a read" << std::endl;
+        return false;
+    }
+
+    std::vector<double> latencies(count); // us
+    auto memory = Memory::sample(pid);
+    std::atomic<unsigned> next { 0 };
+    std::atomic<bool> failed { false };
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            std::mt19937_64 random(t + 1);
+            std::vector<uint8_t> buffer(size);
+            for (unsigned i; (i = next++) < count && !failed;) {
+                const auto& plot = files[random() % files.size()];
+                auto offset = random() % (plot.size - size + 1);
+                auto begin = Clock::now();
+                if (plot.file->pread(buffer.data(), size, offset) != static_cast<int>(size)) {
+                    failed = true;
+                }
+                latencies[i] = elapsed_ms(begin) * 1000;
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    if (failed) {
+        std::cerr << "read failed" << std::endl;
+        return false;
+    }
+    auto seconds = elapsed_ms(start) / 1000;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies[std::min<size_t>(count - 1, count * p)]; };
+    std::cout << count << " reads of " << size << " bytes by " << threads << " threads in " << seconds << " s, "
+              << count / seconds << " reads/s, " << count * size / seconds / 1e6 << " MB/s" << std::endl;
+    std::cout << "latency us: p50 " << percentile(0.5) << ", p90 " << percentile(0.9) << ", p99 " << percentile(0.99)
+              << ", max " << latencies.back() << std::endl;
+    memory.report(pid);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    CLI::App app { "Read benchmark for mount.plotfs" };
+
+    std::string path;
+    app.add_option("path", path, "Mount point, or a single plot")->required();
+
+    bool header = false;
+    app.add_flag("--header", header, "Open every plot and read its header, several times");
+
+    bool stream = false;
+    double limit = 10;
+    pid_t pid = 0;
+    app.add_flag("--stream", stream, "Read plots from start to end");
+    app.add_option("--limit", limit, "GB read by --stream");
+    app.add_option("--pid", pid, "Process id of mount.plotfs, to report its CPU time and RSS");
+
+    bool random = false;
+    unsigned threads = 16, count = 10000;
+    app.add_flag("--random", random, "Read at random offsets from several threads");
+    app.add_option("--threads", threads, "Threads issuing --random reads");
+    app.add_option("--count", count, "Number of --random reads");
+
+    size_t size = 0;
+    unsigned rounds = 3;
+    app.add_option("--size", size, "Bytes per read, defaults to 4 KiB for --header, 64 KiB for --random and 1 MiB for --stream");
+    app.add_option("--rounds", rounds, "Rounds of --header");
+    CLI11_PARSE(app, argc, argv);
+
+    auto plots = find_plots(path);
+    if (plots.empty()) {
+        std::cerr << "no plots found in " << path << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (header) {
+        return bench_headers(plots, size ? size : 4096, rounds) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (stream) {
+        return bench_stream(plots, size ? size : 1024 * 1024, limit * 1e9, pid) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (random && threads > 0 && count > 0) {
+        return bench_random(plots, size ? size : 64 * 1024, threads, count, pid) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    std::cerr << "nothing to do, pick a benchmark" << std::endl;
+    return EXIT_FAILURE;
+}
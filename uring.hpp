@@ -0,0 +1,213 @@
+#pragma once
+
+#ifdef PLOTFS_HAVE_IO_URING
+
+#include <liburing.h>
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Asynchronous positional reads on top of io_uring. Reads may be submitted from
+// any thread, they target registered files and fixed buffers, and complete on a
+// dedicated thread that hands the result to the completion callback.
+class UringEngine {
+public:
+    using Completion = std::function<void(void* user, int result)>;
+
+private:
+    struct io_uring ring;
+    bool ring_ready = false; // queue initialized, torn down by the destructor only
+    std::mutex submit_lock; // the submission queue has a single producer
+    std::thread completer;
+    Completion on_complete;
+    bool stopping = false;
+
+    size_t buffer_size_ = 0;
+    std::vector<std::unique_ptr<uint8_t[]>> buffers;
+    std::mutex buffers_lock;
+    std::vector<int> free_buffers;
+
+    std::mutex files_lock;
+    std::vector<int> free_files;
+
+    UringEngine(Completion on_complete)
+        : on_complete(std::move(on_complete)) {};
+
+    void run()
+    {
+        while (true) {
+            struct io_uring_cqe* cqe = nullptr;
+            auto err = io_uring_wait_cqe(&ring, &cqe);
+            if (err == -EINTR) {
+                continue;
+            } else if (err < 0) {
+                std::cerr << "io_uring_wait_cqe failed: " << strerror(-err) << std::endl;
+                return;
+            }
+            auto user = io_uring_cqe_get_data(cqe);
+            auto result = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            if (!user) {
+                // link timeouts and the shutdown sentinel
+                if (stopping) {
+                    return;
+                }
+                continue;
+            }
+            on_complete(user, result);
+        }
+    }
+
+public:
+    UringEngine(const UringEngine&) = delete;
+    ~UringEngine()
+    {
+        if (!ring_ready) {
+            return;
+        }
+        if (completer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(submit_lock);
+                stopping = true;
+                auto sqe = io_uring_get_sqe(&ring);
+                if (sqe) {
+                    io_uring_prep_nop(sqe);
+                    io_uring_sqe_set_data(sqe, nullptr);
+                    io_uring_submit(&ring);
+                }
+            }
+            completer.join();
+        }
+        io_uring_queue_exit(&ring);
+    }
+
+    // Returns nullptr if io_uring is not available on this kernel
+    static std::shared_ptr<UringEngine> create(unsigned depth, size_t buffer_size, unsigned max_files, Completion on_complete)
+    {
+        auto engine = std::shared_ptr<UringEngine>(new UringEngine(std::move(on_complete)));
+        auto err = io_uring_queue_init(depth * 2, &engine->ring, 0);
+        if (err < 0) {
+            std::cerr << "warning: io_uring unavailable: " << strerror(-err) << std::endl;
+            return nullptr;
+        }
+        engine->ring_ready = true;
+
+        std::vector<struct iovec> iov(depth);
+        for (unsigned i = 0; i < depth; ++i) {
+            engine->buffers.emplace_back(new uint8_t[buffer_size]);
+            iov[i].iov_base = engine->buffers.back().get();
+            iov[i].iov_len = buffer_size;
+            engine->free_buffers.push_back(i);
+        }
+        engine->buffer_size_ = buffer_size;
+        if ((err = io_uring_register_buffers(&engine->ring, iov.data(), iov.size())) < 0) {
+            std::cerr << "warning: io_uring failed to register buffers: " << strerror(-err) << std::endl;
+            return nullptr;
+        }
+        // an empty table, slots are filled in by register_file(). Registering
+        // -1 works from Linux 5.5 on, io_uring_register_files_sparse needs 5.19.
+        std::vector<int> files(max_files, -1);
+        if ((err = io_uring_register_files(&engine->ring, files.data(), files.size())) < 0) {
+            std::cerr << "warning: io_uring failed to register files: " << strerror(-err) << std::endl;
+            return nullptr;
+        }
+        for (int i = max_files - 1; i >= 0; --i) {
+            engine->free_files.push_back(i);
+        }
+
+        engine->completer = std::thread([e = engine.get()]() { e->run(); });
+        return engine;
+    }
+
+    size_t buffer_size() const { return buffer_size_; }
+
+    // Returns a fixed buffer index, or -1 if all buffers are in use
+    int acquire_buffer()
+    {
+        std::lock_guard<std::mutex> lock(buffers_lock);
+        if (free_buffers.empty()) {
+            return -1;
+        }
+        auto index = free_buffers.back();
+        free_buffers.pop_back();
+        return index;
+    }
+    uint8_t* buffer(int index) { return buffers[index].get(); }
+    void release_buffer(int index)
+    {
+        std::lock_guard<std::mutex> lock(buffers_lock);
+        free_buffers.push_back(index);
+    }
+
+    // Returns a registered file slot for fd, or -1 if the table is full
+    int register_file(int fd)
+    {
+        std::lock_guard<std::mutex> lock(files_lock);
+        if (free_files.empty()) {
+            return -1;
+        }
+        auto slot = free_files.back();
+        if (0 > io_uring_register_files_update(&ring, slot, &fd, 1)) {
+            return -1;
+        }
+        free_files.pop_back();
+        return slot;
+    }
+    void unregister_file(int slot)
+    {
+        std::lock_guard<std::mutex> lock(files_lock);
+        int fd = -1;
+        io_uring_register_files_update(&ring, slot, &fd, 1);
+        free_files.push_back(slot);
+    }
+
+    // Queues reads of size bytes at offset of the registered file into the fixed
+    // buffer, one per entry. on_complete is called once for each of them. With a
+    // timeout, reads still running after timeout_ms are cancelled (-ECANCELED).
+    struct Read {
+        int file;
+        int buffer;
+        uint8_t* data; // inside the fixed buffer
+        size_t size;
+        uint64_t offset;
+        void* user;
+    };
+    bool submit(const Read* reads, size_t count, unsigned timeout_ms = 0)
+    {
+        // read by the kernel when the entries are submitted
+        struct __kernel_timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000ll };
+        unsigned needed = timeout_ms ? 2 : 1;
+        std::lock_guard<std::mutex> lock(submit_lock);
+        for (size_t i = 0; i < count; ++i) {
+            if (io_uring_sq_space_left(&ring) < needed) {
+                io_uring_submit(&ring);
+            }
+            auto sqe = io_uring_sq_space_left(&ring) < needed ? nullptr : io_uring_get_sqe(&ring);
+            if (!sqe) {
+                // reads already queued will still complete
+                std::cerr << "io_uring submission queue full" << std::endl;
+                for (; i < count; ++i) {
+                    on_complete(reads[i].user, -EAGAIN);
+                }
+                break;
+            }
+            io_uring_prep_read_fixed(sqe, reads[i].file, reads[i].data, reads[i].size, reads[i].offset, reads[i].buffer);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            io_uring_sqe_set_data(sqe, reads[i].user);
+            if (timeout_ms) {
+                sqe->flags |= IOSQE_IO_LINK;
+                auto link = io_uring_get_sqe(&ring);
+                io_uring_prep_link_timeout(link, &timeout, 0);
+                io_uring_sqe_set_data(link, nullptr);
+            }
+        }
+        return 0 <= io_uring_submit(&ring);
+    }
+};
+
+#endif
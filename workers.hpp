@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running blocking jobs handed over by other threads
+class WorkerPool {
+public:
+    struct Job {
+        void (*run)(void*);
+        void* arg;
+    };
+
+    // Counts outstanding jobs of one caller so it can wait for all of them
+    class Latch {
+    private:
+        std::mutex m;
+        std::condition_variable cv;
+        size_t pending;
+
+    public:
+        explicit Latch(size_t count)
+            : pending(count) {};
+        void done()
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (--pending == 0) {
+                cv.notify_all();
+            }
+        }
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [this]() { return pending == 0; });
+        }
+    };
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<Job> jobs = std::vector<Job>(64); // ring buffer, only grows so posting does not allocate once warm
+    size_t head = 0;
+    size_t queued = 0;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+public:
+    explicit WorkerPool(unsigned count)
+    {
+        for (unsigned i = 0; i < count; ++i) {
+            threads.emplace_back([this]() {
+                while (true) {
+                    Job job;
+                    {
+                        std::unique_lock<std::mutex> lock(m);
+                        cv.wait(lock, [this]() { return stopping || queued > 0; });
+                        if (queued == 0) {
+                            return;
+                        }
+                        job = jobs[head];
+                        head = (head + 1) % jobs.size(), --queued;
+                    }
+                    job.run(job.arg);
+                }
+            });
+        }
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    void post(Job job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (queued == jobs.size()) {
+                std::rotate(jobs.begin(), jobs.begin() + head, jobs.end());
+                jobs.resize(jobs.size() * 2);
+                head = 0;
+            }
+            jobs[(head + queued++) % jobs.size()] = job;
+        }
+        cv.notify_one();
+    }
+};